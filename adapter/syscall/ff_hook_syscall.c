@@ -41,11 +41,25 @@ struct ff_config ff_global_cfg;
 #define share_mem_alloc(size) rte_malloc(NULL, (size), 0)
 #define share_mem_free(addr) rte_free((addr))
 
+#ifdef FF_MULTI_SC
+/* Use the sc of the instance fd lives in */
+#define ROUTE_FSTACK_FD(fd) do {                                  \
+    sc = ff_instance_sc(fstack_fd_instance(fd));                  \
+    if (unlikely(sc == NULL)) {                                   \
+        errno = EBADF;                                            \
+        return -1;                                                \
+    }                                                             \
+} while (0)
+#else
+#define ROUTE_FSTACK_FD(fd)
+#endif
+
 #define CHECK_FD_OWNERSHIP(name, args)                            \
 {                                                                 \
     if (!is_fstack_fd(fd)) {                                      \
         return ff_linux_##name args;                              \
     }                                                             \
+    ROUTE_FSTACK_FD(fd);                                          \
     fd = restore_fstack_fd(fd);                                   \
 }
 
@@ -80,6 +94,10 @@ static __thread struct ff_fcntl_args *fcntl_args = NULL;
 static __thread struct ff_epoll_ctl_args *epoll_ctl_args = NULL;
 static __thread struct ff_epoll_wait_args *epoll_wait_args = NULL;
 static __thread struct ff_kevent_args *kevent_args = NULL;
+#ifdef FF_SO_ZC
+static __thread struct ff_zc_write_args *zc_write_args = NULL;
+static __thread struct ff_zc_read_args *zc_read_args = NULL;
+#endif
 
 #define IOV_MAX   16
 #define IOV_LEN_MAX     2048
@@ -127,6 +145,7 @@ static __thread int sh_iov_static_fill_idx_share = 0;
     sc->ops = (op);                                               \
     sc->args = (arg);                                             \
     RELEASE_ZONE_LOCK(FF_SC_REQ);                                 \
+    ff_so_doorbell(sc);                                           \
     ACQUIRE_ZONE_LOCK(FF_SC_REP);                                 \
     ret = sc->result;                                             \
     if (ret < 0) {                                                \
@@ -162,19 +181,176 @@ static __thread int sh_iov_static_fill_idx_share = 0;
 static __FF_THREAD int inited = 0;
 static __FF_THREAD struct ff_so_context *sc;
 
+#if defined(FF_SO_BATCH) || defined(FF_SO_ZC)
+/*
+ * Reap the completion ring of sc, must hold sc->sq_lock.
+ * Queued ops have already returned to APP, so only log the failed ones.
+ */
+static inline void
+so_reap_completions(void)
+{
+    uint32_t cq_head = sc->cq_head;
+    uint32_t cq_tail = sc->cq_tail;
+
+    rte_smp_rmb();
+
+    while (cq_head != cq_tail) {
+        struct ff_so_cqe *cqe = &sc->cq[cq_head & FF_SO_RING_MASK];
+        if (unlikely(cqe->result < 0)) {
+            ERR_LOG("queued ops:%d failed, fd:%lu, result:%d, errno:%d\n",
+                cqe->ops, cqe->user_data, cqe->result, cqe->error);
+        }
+        cq_head++;
+    }
+
+    sc->cq_head = cq_head;
+}
+
+/* Get a free submission entry of sc, and hold sc->sq_lock until so_submit_sqe */
+static inline struct ff_so_sqe *
+so_get_sqe(void)
+{
+    rte_spinlock_lock(&sc->sq_lock);
+
+    so_reap_completions();
+    while (unlikely(sc->sq_tail - sc->sq_head >= FF_SO_RING_SIZE)) {
+        rte_pause();
+        so_reap_completions();
+    }
+
+    return &sc->sq[sc->sq_tail & FF_SO_RING_MASK];
+}
+
+static inline void
+so_submit_sqe(void)
+{
+    /* Publish the entry before the tail */
+    rte_smp_wmb();
+    sc->sq_tail++;
+    rte_spinlock_unlock(&sc->sq_lock);
+    ff_so_doorbell(sc);
+}
+#endif
+
+#ifdef FF_SO_ZC
+/* Below it, the staging copy is cheap enough */
+#define ZC_LEN_MIN 4096
+
+/*
+ * Copy the data once into a shared buffer that the fstack instance attaches
+ * to the socket buffer, instead of copying it again into mbufs.
+ */
+static ssize_t
+zc_write(int fd, const void *buf, size_t len, int flags)
+{
+    DEFINE_REQ_ARGS_STATIC(zc_write);
+    void *zbuf;
+
+    /* Owned and freed by the fstack instance from now on */
+    zbuf = share_mem_alloc(len);
+    if (zbuf == NULL) {
+        RETURN_ERROR_NOFREE(ENOMEM);
+    }
+    rte_memcpy(zbuf, buf, len);
+
+    args->fd = fd;
+    args->buf = zbuf;
+    args->len = len;
+    args->flags = flags;
+
+    SYSCALL(FF_SO_ZC_WRITE, args);
+
+    RETURN_NOFREE();
+}
+
+/*
+ * Copy the data directly out of the received mbufs, and give them back
+ * through the submission ring, without waiting.
+ */
+static ssize_t
+zc_read(int fd, void *buf, size_t len, int flags)
+{
+    DEFINE_REQ_ARGS_STATIC(zc_read);
+    static __thread void *sh_buf = NULL;
+    static __thread size_t sh_buf_len = 0;
+    static __thread struct iovec *sh_iov = NULL;
+
+    if (sh_iov == NULL) {
+        sh_iov = share_mem_alloc(sizeof(struct iovec) * FF_ZC_IOV_MAX);
+        if (sh_iov == NULL) {
+            RETURN_ERROR_NOFREE(ENOMEM);
+        }
+    }
+
+    /* Only used if the mbufs are not in shared memory */
+    if (sh_buf == NULL || sh_buf_len < len) {
+        if (sh_buf) {
+            share_mem_free(sh_buf);
+        }
+
+        sh_buf_len = len;
+        sh_buf = share_mem_alloc(sh_buf_len);
+        if (sh_buf == NULL) {
+            RETURN_ERROR_NOFREE(ENOMEM);
+        }
+    }
+
+    args->fd = fd;
+    args->buf = sh_buf;
+    args->len = len;
+    args->flags = flags;
+    args->iov = sh_iov;
+
+    SYSCALL(FF_SO_ZC_READ, args);
+
+    if (ret > 0) {
+        if (args->mbuf) {
+            struct ff_so_sqe *sqe;
+            size_t off = 0;
+            int i;
+
+            for (i = 0; i < args->iovcnt; i++) {
+                rte_memcpy((char *)buf + off, sh_iov[i].iov_base,
+                    sh_iov[i].iov_len);
+                off += sh_iov[i].iov_len;
+            }
+
+            sqe = so_get_sqe();
+            sqe->ops = FF_SO_ZC_FREE;
+            sqe->user_data = fd;
+            sqe->args.zc_free.mbuf = args->mbuf;
+            so_submit_sqe();
+        } else {
+            rte_memcpy(buf, sh_buf, ret);
+        }
+    }
+
+    RETURN_NOFREE();
+}
+#endif
+
 /*
  * For parent process socket/bind/listen multi sockets
  * and use them in different child process,
  * like Nginx with reuseport.
+ *
+ * Every fd returned to APP carries the instance it lives in (see
+ * convert_fstack_fd()), so each process or thread can use any of them,
+ * through the sc it attached to that instance.
  */
 #ifdef FF_MULTI_SC
-typedef struct ff_multi_sc {
-    int worker_id;
-    int fd;
-    struct ff_so_context *sc;
-} ff_multi_sc_type;
+/* sc of this process or thread in each instance, attached on first use */
+static __FF_THREAD struct ff_so_context *inst_scs[SOCKET_OPS_ZONE_MAX_NUM];
 
-static ff_multi_sc_type scs[SOCKET_OPS_CONTEXT_MAX_NUM];
+/* Instance of the sc attached by ff_adapter_init or fork, epoll fds are created there */
+static __FF_THREAD int home_inst = 0;
+
+/*
+ * Parent process spreads its sockets over all instances round robin,
+ * the child worker process creates them in its home instance.
+ */
+static int so_spread = 1;
+static __FF_THREAD int next_inst = 0;
 
 /*
  * For child worker process,
@@ -184,6 +360,53 @@ static ff_multi_sc_type scs[SOCKET_OPS_CONTEXT_MAX_NUM];
  */
 #define CURRENT_WORKER_ID_DEFAULT 0
 static int current_worker_id = CURRENT_WORKER_ID_DEFAULT;
+
+/*
+ * What APP needs to remember about some fds of F-Stack:
+ * the address a socket bound to, to balance accept with sockets bound to
+ * it in other instances, and the epoll fd created in each instance for
+ * one epoll fd of APP.
+ */
+enum FF_FD_ROUTE_TYPE {
+    FF_ROUTE_BOUND,
+    FF_ROUTE_EPOLL,
+};
+
+/*
+ * Readers hold a reference across their use, the table holds one until the
+ * fd is closed, the last one frees the route.
+ */
+struct ff_fd_route {
+    enum FF_FD_ROUTE_TYPE type;
+    /* APP fd */
+    int fd;
+    uint32_t refcnt;
+    union {
+        struct sockaddr_in6 addr;
+        struct {
+            /* Instances that have an epoll fd */
+            uint32_t mask;
+            /* Instance to give events room first next time */
+            uint32_t next;
+            int fd[SOCKET_OPS_ZONE_MAX_NUM];
+        } ep;
+    };
+};
+
+/* Open addressing hash table of APP fd, must be power of 2 */
+#define FF_FD_ROUTE_NUM 1024
+#define FF_FD_ROUTE_MASK (FF_FD_ROUTE_NUM - 1)
+#define FF_FD_ROUTE_EMPTY 0
+#define FF_FD_ROUTE_DELETED -1
+
+static struct {
+    int fd;
+    struct ff_fd_route *route;
+} fd_routes[FF_FD_ROUTE_NUM];
+static int fd_routes_nb = 0;
+/* Routes by home slot, read without the lock to skip fds that have none */
+static uint16_t fd_routes_home[FF_FD_ROUTE_NUM];
+static rte_spinlock_t fd_routes_lock = RTE_SPINLOCK_INITIALIZER;
 #endif
 
 static pthread_key_t key;
@@ -192,6 +415,9 @@ static pthread_key_t key;
 /* kern.maxfiles: 33554432 */
 #define FF_MAX_FREEBSD_FILES 65536
 int fstack_kernel_fd_map[FF_MAX_FREEBSD_FILES];
+
+/* Max kernel events of one ff_hook_epoll_wait */
+#define KERNEL_MAXEVENTS_MAX 32
 #endif
 
 /* process-level initialization flag */
@@ -219,6 +445,30 @@ static int ff_kernel_max_fd = FF_KERNEL_MAX_FD_DEFAULT;
 /* not support thread socket now */
 static int need_alarm_sem = 0;
 
+#ifdef FF_MULTI_SC
+/* fd of APP is ((fd in instance << SOCKET_OPS_ZONE_SHIFT) | instance) + ff_kernel_max_fd */
+static inline int convert_fstack_fd_inst(int sockfd, int inst) {
+    return ((sockfd << SOCKET_OPS_ZONE_SHIFT) | inst) + ff_kernel_max_fd;
+}
+
+/* Of the instance sc just called */
+static inline int convert_fstack_fd(int sockfd) {
+    return convert_fstack_fd_inst(sockfd, sc->zone->proc_id);
+}
+
+static inline int fstack_fd_instance(int sockfd) {
+    return (sockfd - ff_kernel_max_fd) & (SOCKET_OPS_ZONE_MAX_NUM - 1);
+}
+
+/* Restore socket fd. */
+static inline int restore_fstack_fd(int sockfd) {
+    if(sockfd < ff_kernel_max_fd) {
+        return sockfd;
+    }
+
+    return (sockfd - ff_kernel_max_fd) >> SOCKET_OPS_ZONE_SHIFT;
+}
+#else
 static inline int convert_fstack_fd(int sockfd) {
     return sockfd + ff_kernel_max_fd;
 }
@@ -231,6 +481,7 @@ static inline int restore_fstack_fd(int sockfd) {
 
     return sockfd - ff_kernel_max_fd;
 }
+#endif
 
 int is_fstack_fd(int sockfd) {
     if (unlikely(inited == 0/* && ff_adapter_init() < 0*/)) {
@@ -241,6 +492,200 @@ int is_fstack_fd(int sockfd) {
     return sockfd >= ff_kernel_max_fd;
 }
 
+#ifdef FF_MULTI_SC
+/* sc of this process or thread in instance inst, attach it if not yet */
+static struct ff_so_context *
+ff_instance_sc(int inst)
+{
+    if (likely(inst_scs[inst] != NULL)) {
+        return inst_scs[inst];
+    }
+
+    if (inst >= nb_procs) {
+        ERR_LOG("invalid instance:%d, nb_procs:%d\n", inst, nb_procs);
+        return NULL;
+    }
+
+    inst_scs[inst] = ff_attach_so_context(inst);
+
+    return inst_scs[inst];
+}
+
+/* Instance of the next socket */
+static inline int
+ff_socket_instance(void)
+{
+    int inst = home_inst;
+
+    if (so_spread) {
+        inst = next_inst;
+        next_inst = (next_inst + 1) % nb_procs;
+    }
+
+    return inst;
+}
+
+static inline uint32_t
+ff_fd_route_hash(int fd)
+{
+    return ((uint32_t)fd * 0x9e3779b1U) >> 16;
+}
+
+/* Route of fd with a reference, to drop with ff_fd_route_put() */
+static struct ff_fd_route *
+ff_fd_route_get(int fd)
+{
+    uint32_t i, slot = ff_fd_route_hash(fd);
+    struct ff_fd_route *route = NULL;
+
+    if (__atomic_load_n(&fd_routes_home[slot & FF_FD_ROUTE_MASK],
+        __ATOMIC_RELAXED) == 0) {
+        return NULL;
+    }
+
+    rte_spinlock_lock(&fd_routes_lock);
+    for (i = 0; i < FF_FD_ROUTE_NUM; i++, slot++) {
+        int cur = fd_routes[slot & FF_FD_ROUTE_MASK].fd;
+        if (cur == fd) {
+            route = fd_routes[slot & FF_FD_ROUTE_MASK].route;
+            __atomic_fetch_add(&route->refcnt, 1, __ATOMIC_RELAXED);
+            break;
+        }
+
+        if (cur == FF_FD_ROUTE_EMPTY) {
+            break;
+        }
+    }
+    rte_spinlock_unlock(&fd_routes_lock);
+
+    return route;
+}
+
+static void ff_fd_route_put(struct ff_fd_route *route);
+
+static int
+ff_fd_route_set(int fd, struct ff_fd_route *route)
+{
+    uint32_t i, home = ff_fd_route_hash(fd), slot = home;
+    int ret = -1;
+
+    route->fd = fd;
+    route->refcnt = 1;
+
+    rte_spinlock_lock(&fd_routes_lock);
+    for (i = 0; i < FF_FD_ROUTE_NUM; i++, slot++) {
+        int cur = fd_routes[slot & FF_FD_ROUTE_MASK].fd;
+        if (cur != FF_FD_ROUTE_EMPTY && cur != FF_FD_ROUTE_DELETED) {
+            continue;
+        }
+
+        fd_routes[slot & FF_FD_ROUTE_MASK].route = route;
+        fd_routes[slot & FF_FD_ROUTE_MASK].fd = fd;
+        fd_routes_nb++;
+        __atomic_store_n(&fd_routes_home[home & FF_FD_ROUTE_MASK],
+            fd_routes_home[home & FF_FD_ROUTE_MASK] + 1, __ATOMIC_RELAXED);
+        ret = 0;
+        break;
+    }
+    rte_spinlock_unlock(&fd_routes_lock);
+
+    return ret;
+}
+
+static struct ff_fd_route *
+ff_fd_route_del(int fd)
+{
+    uint32_t i, home = ff_fd_route_hash(fd), slot = home;
+    struct ff_fd_route *route = NULL;
+
+    if (__atomic_load_n(&fd_routes_home[home & FF_FD_ROUTE_MASK],
+        __ATOMIC_RELAXED) == 0) {
+        return NULL;
+    }
+
+    rte_spinlock_lock(&fd_routes_lock);
+    for (i = 0; i < FF_FD_ROUTE_NUM; i++, slot++) {
+        int cur = fd_routes[slot & FF_FD_ROUTE_MASK].fd;
+        if (cur == fd) {
+            route = fd_routes[slot & FF_FD_ROUTE_MASK].route;
+            fd_routes_nb--;
+            __atomic_store_n(&fd_routes_home[home & FF_FD_ROUTE_MASK],
+                fd_routes_home[home & FF_FD_ROUTE_MASK] - 1,
+                __ATOMIC_RELAXED);
+
+            fd_routes[slot & FF_FD_ROUTE_MASK].fd = FF_FD_ROUTE_DELETED;
+
+            /* No probe goes past an empty slot, so empty the tail of the run */
+            if (fd_routes[(slot + 1) & FF_FD_ROUTE_MASK].fd ==
+                FF_FD_ROUTE_EMPTY) {
+                for (i = 0; i < FF_FD_ROUTE_NUM &&
+                    fd_routes[slot & FF_FD_ROUTE_MASK].fd ==
+                    FF_FD_ROUTE_DELETED; i++, slot--) {
+                    fd_routes[slot & FF_FD_ROUTE_MASK].fd = FF_FD_ROUTE_EMPTY;
+                }
+            }
+            break;
+        }
+
+        if (cur == FF_FD_ROUTE_EMPTY) {
+            break;
+        }
+    }
+    rte_spinlock_unlock(&fd_routes_lock);
+
+    return route;
+}
+
+/*
+ * Listen socket to accept from: of the sockets bound to the same address
+ * as fd in all instances, the one with the most complete connections,
+ * fd itself on tie.
+ */
+static int
+ff_accept_balance(int fd)
+{
+    struct ff_fd_route *route;
+    struct ff_bound_info *info;
+    int i, inst, best_fd = fd, best_qlen = 0;
+
+    if (nb_procs <= 1 || fd_routes_nb == 0) {
+        return fd;
+    }
+
+    route = ff_fd_route_get(fd);
+    if (route == NULL) {
+        return fd;
+    }
+
+    if (route->type != FF_ROUTE_BOUND) {
+        ff_fd_route_put(route);
+        return fd;
+    }
+
+    inst = fstack_fd_instance(fd);
+    info = ff_bound_lookup(ff_so_zones[inst], (struct sockaddr *)&route->addr);
+    if (info != NULL) {
+        best_qlen = info->qlen;
+    }
+
+    for (i = 0; i < nb_procs; i++) {
+        if (i == inst || ff_so_zones[i] == NULL) {
+            continue;
+        }
+
+        info = ff_bound_lookup(ff_so_zones[i], (struct sockaddr *)&route->addr);
+        if (info != NULL && info->qlen > best_qlen) {
+            best_qlen = info->qlen;
+            best_fd = convert_fstack_fd_inst(info->fd, i);
+        }
+    }
+
+    ff_fd_route_put(route);
+
+    return best_fd;
+}
+#endif
+
 int
 fstack_territory(int domain, int type, int protocol)
 {
@@ -279,12 +724,13 @@ ff_hook_socket(int domain, int type, int protocol)
             return ff_linux_socket(domain, type, protocol);
         }
     }
+
 #ifdef FF_MULTI_SC
-    else {
-        if (ff_adapter_init() < 0) {
-            ERR_LOG("FF_MUTLI_SC ff_adapter_init failed\n");
-            return -1;
-        }
+    sc = ff_instance_sc(ff_socket_instance());
+    if (sc == NULL) {
+        ERR_LOG("FF_MUTLI_SC attach sc failed\n");
+        errno = ENOMEM;
+        return -1;
     }
 #endif
 
@@ -298,10 +744,6 @@ ff_hook_socket(int domain, int type, int protocol)
 
     SYSCALL(FF_SO_SOCKET, args);
 
-#ifdef FF_MULTI_SC
-    scs[worker_id - 1].fd = ret;
-#endif
-
     if (ret >= 0) {
         ret = convert_fstack_fd(ret);
     }
@@ -322,6 +764,10 @@ ff_hook_bind(int fd, const struct sockaddr *addr,
         return -1;
     }
 
+#ifdef FF_MULTI_SC
+    int sockfd = fd;
+#endif
+
     CHECK_FD_OWNERSHIP(bind, (fd, addr, addrlen));
 
     DEFINE_REQ_ARGS(bind);
@@ -339,6 +785,22 @@ ff_hook_bind(int fd, const struct sockaddr *addr,
 
     SYSCALL(FF_SO_BIND, args);
 
+#ifdef FF_MULTI_SC
+    /* Sockets bound to the same address in other instances share accept */
+    if (ret == 0 && nb_procs > 1 && addrlen <= sizeof(struct sockaddr_in6) &&
+        (addr->sa_family == AF_INET || addr->sa_family == AF_INET6)) {
+        struct ff_fd_route *route = calloc(1, sizeof(struct ff_fd_route));
+        if (route != NULL) {
+            route->type = FF_ROUTE_BOUND;
+            rte_memcpy(&route->addr, addr, addrlen);
+            if (ff_fd_route_set(sockfd, route) < 0) {
+                ERR_LOG("fd route table full, fd:%d accept not balanced\n", sockfd);
+                free(route);
+            }
+        }
+    }
+#endif
+
     share_mem_free(sh_addr);
     RETURN();
 }
@@ -587,17 +1049,9 @@ ff_hook_setsockopt(int fd, int level, int optname,
     RETURN_NOFREE();
 }
 
-int
-ff_hook_accept(int fd, struct sockaddr *addr, socklen_t *addrlen)
+static int
+ff_accept_fstack(int fd, struct sockaddr *addr, socklen_t *addrlen)
 {
-    DEBUG_LOG("ff_hook_accept, fd:%d, addr:%p, len:%p\n", fd, addr, addrlen);
-
-    if ((addr == NULL && addrlen != NULL) ||
-        (addr != NULL && addrlen == NULL)) {
-        errno = EINVAL;
-        return -1;
-    }
-
     CHECK_FD_OWNERSHIP(accept, (fd, addr, addrlen));
 
     DEFINE_REQ_ARGS_STATIC(accept);
@@ -656,6 +1110,33 @@ ff_hook_accept(int fd, struct sockaddr *addr, socklen_t *addrlen)
     RETURN_NOFREE();
 }
 
+int
+ff_hook_accept(int fd, struct sockaddr *addr, socklen_t *addrlen)
+{
+    DEBUG_LOG("ff_hook_accept, fd:%d, addr:%p, len:%p\n", fd, addr, addrlen);
+
+    if ((addr == NULL && addrlen != NULL) ||
+        (addr != NULL && addrlen == NULL)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+#ifdef FF_MULTI_SC
+    if (is_fstack_fd(fd)) {
+        int lfd = ff_accept_balance(fd);
+        if (lfd != fd) {
+            int ret = ff_accept_fstack(lfd, addr, addrlen);
+            /* Drained or closed meanwhile, accept from fd itself */
+            if (ret >= 0) {
+                return ret;
+            }
+        }
+    }
+#endif
+
+    return ff_accept_fstack(fd, addr, addrlen);
+}
+
 int
 ff_hook_accept4(int fd, struct sockaddr *addr,
     socklen_t *addrlen, int flags)
@@ -737,6 +1218,12 @@ ff_hook_recvfrom(int fd, void *buf, size_t len, int flags,
 
     CHECK_FD_OWNERSHIP(recvfrom, (fd, buf, len, flags, from, fromlen));
 
+#ifdef FF_SO_ZC
+    if (from == NULL && !(flags & MSG_PEEK) && len >= ZC_LEN_MIN) {
+        return zc_read(fd, buf, len, flags);
+    }
+#endif
+
     DEFINE_REQ_ARGS_STATIC(recvfrom);
     static __thread void *sh_buf = NULL;
     static __thread size_t sh_buf_len = 0;
@@ -1200,6 +1687,12 @@ ff_hook_read(int fd, void *buf, size_t len)
 
     CHECK_FD_OWNERSHIP(read, (fd, buf, len));
 
+#ifdef FF_SO_ZC
+    if (len >= ZC_LEN_MIN) {
+        return zc_read(fd, buf, len, 0);
+    }
+#endif
+
     DEFINE_REQ_ARGS_STATIC(read);
     static __thread void *sh_buf = NULL;
     static __thread size_t sh_buf_len = 0;
@@ -1288,6 +1781,12 @@ ff_hook_sendto(int fd, const void *buf, size_t len, int flags,
 
     CHECK_FD_OWNERSHIP(sendto, (fd, buf, len, flags, to, tolen));
 
+#ifdef FF_SO_ZC
+    if (to == NULL && len >= ZC_LEN_MIN) {
+        return zc_write(fd, buf, len, flags);
+    }
+#endif
+
     DEFINE_REQ_ARGS_STATIC(sendto);
     static __thread void *sh_buf = NULL;
     static __thread size_t sh_buf_len = 0;
@@ -1414,6 +1913,12 @@ ff_hook_write(int fd, const void *buf, size_t len)
 
     CHECK_FD_OWNERSHIP(write, (fd, buf, len));
 
+#ifdef FF_SO_ZC
+    if (len >= ZC_LEN_MIN) {
+        return zc_write(fd, buf, len, 0);
+    }
+#endif
+
     DEFINE_REQ_ARGS_STATIC(write);
     static __thread void *sh_buf = NULL;
     static __thread size_t sh_buf_len = 0;
@@ -1510,34 +2015,69 @@ ff_hook_writev(int fd, const struct iovec *iov, int iovcnt)
     RETURN_NOFREE();
 }
 
+#ifdef FF_MULTI_SC
+/*
+ * Drop a reference, the last one closes the epoll fds created in other
+ * instances for the route and frees it.
+ */
+static void
+ff_fd_route_put(struct ff_fd_route *route)
+{
+    int i, inst;
+
+    if (__atomic_sub_fetch(&route->refcnt, 1, __ATOMIC_ACQ_REL) != 0) {
+        return;
+    }
+
+    if (route->type == FF_ROUTE_EPOLL) {
+        inst = fstack_fd_instance(route->fd);
+        for (i = 0; i < nb_procs; i++) {
+            if (i != inst && (route->ep.mask & (1U << i))) {
+                ff_hook_close(convert_fstack_fd_inst(route->ep.fd[i], i));
+            }
+        }
+    }
+
+    free(route);
+}
+
+/* Forget fd, readers still using its route keep it until they are done */
+static void
+ff_fd_route_release(int fd)
+{
+    struct ff_fd_route *route = ff_fd_route_del(fd);
+
+    if (route != NULL) {
+        ff_fd_route_put(route);
+    }
+}
+#endif
+
 int
 ff_hook_close(int fd)
 {
     DEBUG_LOG("ff_hook_close, fd:%d\n", fd);
 
+#ifdef FF_MULTI_SC
+    if (fd_routes_nb > 0 && is_fstack_fd(fd)) {
+        ff_fd_route_release(fd);
+    }
+#endif
+
     CHECK_FD_OWNERSHIP(close, (fd));
 
-    DEFINE_REQ_ARGS_STATIC(close);
+#ifdef FF_SO_BATCH
+    struct ff_so_sqe *sqe = so_get_sqe();
+    sqe->ops = FF_SO_CLOSE;
+    sqe->user_data = fd;
+    sqe->args.close.fd = fd;
+    so_submit_sqe();
 
-#ifdef FF_MULTI_SC
-    /*
-     * Hear don't care if the fd belong to this worker sc,
-     * just scs[i].fd == fd, to close it
-     * until the loop close all fd.
-     */
-    if (unlikely(current_worker_id == worker_id)) {
-        int i;
-        for (i = 0; i < worker_id; i++) {
-            if (scs[i].fd == fd) {
-                ERR_LOG("worker_id:%d, fd:%d, sc:%p, sc->fd:%d, sc->worker_id:%d\n",
-                    i, fd, scs[i].sc, scs[i].fd, scs[i].worker_id);
-                sc = scs[i].sc;
-                scs[i].fd = -1;
-                break;
-            }
-        }
-    }
+    return 0;
 #endif
+
+    DEFINE_REQ_ARGS_STATIC(close);
+
     args->fd = fd;
 
     SYSCALL(FF_SO_CLOSE, args);
@@ -1623,6 +2163,19 @@ ff_hook_epoll_create(int fdsize)
         return ff_linux_epoll_create(fdsize);
     }
 
+#ifdef FF_MULTI_SC
+    struct ff_fd_route *route;
+
+    sc = ff_instance_sc(home_inst);
+    route = calloc(1, sizeof(struct ff_fd_route));
+    if (sc == NULL || route == NULL) {
+        free(route);
+        errno = ENOMEM;
+        return -1;
+    }
+    route->type = FF_ROUTE_EPOLL;
+#endif
+
     DEFINE_REQ_ARGS(epoll_create);
 
     args->size = size;
@@ -1640,11 +2193,76 @@ ff_hook_epoll_create(int fdsize)
         ret = convert_fstack_fd(ret);
     }
 
+#ifdef FF_MULTI_SC
+    /* Epoll fds of other instances are created by epoll_ctl when needed */
+    if (ret >= 0) {
+        route->ep.mask = 1U << home_inst;
+        route->ep.fd[home_inst] = restore_fstack_fd(ret);
+        if (ff_fd_route_set(ret, route) < 0) {
+            ERR_LOG("fd route table full, epfd:%d only waits on instance %d\n", ret, home_inst);
+            free(route);
+        }
+    } else {
+        free(route);
+    }
+#endif
+
     ERR_LOG("ff_hook_epoll_create return fd:%d\n", ret);
 
     RETURN();
 }
 
+#ifdef FF_MULTI_SC
+/* Create the epoll fd in instance inst for the epoll route of epfd */
+static int
+ff_epoll_instance_create(struct ff_fd_route *route, int epfd, int inst)
+{
+    DEFINE_REQ_ARGS(epoll_create);
+
+    args->size = 1;
+
+    SYSCALL(FF_SO_EPOLL_CREATE, args);
+
+    if (ret >= 0) {
+        route->ep.fd[inst] = ret;
+        rte_smp_wmb();
+        route->ep.mask |= 1U << inst;
+        ERR_LOG("epfd:%d, epoll fd:%d created in instance:%d\n", epfd, ret, inst);
+    }
+
+    RETURN();
+}
+
+/* Epoll fd in instance inst for epfd of APP, create it if not yet */
+static int
+ff_epoll_instance_fd(int epfd, int inst)
+{
+    struct ff_fd_route *route;
+    int fd;
+
+    route = ff_fd_route_get(epfd);
+    if (route == NULL || route->type != FF_ROUTE_EPOLL) {
+        if (route != NULL) {
+            ff_fd_route_put(route);
+        }
+        if (fstack_fd_instance(epfd) != inst) {
+            errno = EXDEV;
+            return -1;
+        }
+        return restore_fstack_fd(epfd);
+    }
+
+    if (likely(route->ep.mask & (1U << inst))) {
+        fd = route->ep.fd[inst];
+    } else {
+        fd = ff_epoll_instance_create(route, epfd, inst);
+    }
+    ff_fd_route_put(route);
+
+    return fd;
+}
+#endif
+
 int
 ff_hook_epoll_ctl(int epfd, int op, int fd,
     struct epoll_event *event)
@@ -1668,12 +2286,27 @@ ff_hook_epoll_ctl(int epfd, int op, int fd,
         }
         return ff_linux_epoll_ctl(epfd, op, fd, event);
     }
+#ifdef FF_MULTI_SC
+    int sockfd = fd;
+    ROUTE_FSTACK_FD(fd);
+#endif
     fd = restore_fstack_fd(fd);
 #else
+#ifdef FF_MULTI_SC
+    int sockfd = fd;
+#endif
     CHECK_FD_OWNERSHIP(epoll_ctl, (epfd, op, fd, event));
 #endif
     ff_epfd = restore_fstack_fd(epfd);
 
+#ifdef FF_MULTI_SC
+    /* Register fd to the epoll fd of its own instance */
+    ff_epfd = ff_epoll_instance_fd(epfd, fstack_fd_instance(sockfd));
+    if (ff_epfd < 0) {
+        return -1;
+    }
+#endif
+
     DEFINE_REQ_ARGS_STATIC(epoll_ctl);
     static __thread struct epoll_event *sh_event = NULL;
 
@@ -1685,6 +2318,22 @@ ff_hook_epoll_ctl(int epfd, int op, int fd,
         return -1;
     }
 
+#ifdef FF_SO_BATCH
+    /* ADD/MOD stay synchronous, APP relies on their EEXIST/ENOENT */
+    if (op == EPOLL_CTL_DEL) {
+        struct ff_so_sqe *sqe = so_get_sqe();
+        sqe->ops = FF_SO_EPOLL_CTL;
+        sqe->user_data = fd;
+        sqe->args.epoll_ctl.epfd = ff_epfd;
+        sqe->args.epoll_ctl.op = op;
+        sqe->args.epoll_ctl.fd = fd;
+        sqe->args.epoll_ctl.event = NULL;
+        so_submit_sqe();
+
+        return 0;
+    }
+#endif
+
     if (event) {
         if (sh_event == NULL) {
             sh_event = share_mem_alloc(sizeof(struct epoll_event));
@@ -1711,6 +2360,173 @@ ff_hook_epoll_ctl(int epfd, int op, int fd,
     RETURN_NOFREE();
 }
 
+#ifdef FF_MULTI_SC
+/*
+ * epoll_wait of an epoll fd with fds in several instances.
+ *
+ * Post epoll_wait to the epoll fd of every instance at once, all of them
+ * post the semaphore of the home sc, then take the events of those that
+ * replied and cancel the others. maxevents is shared out between the
+ * instances, so no event is taken from F-Stack that can't be returned.
+ */
+static int
+ff_multi_epoll_wait(struct ff_fd_route *route, int ff_epfd,
+    struct epoll_event *events, int maxevents, int kernel_maxevents,
+    int timeout, struct timespec *abs_timeout)
+{
+    static __thread struct ff_epoll_wait_args *multi_args[SOCKET_OPS_ZONE_MAX_NUM];
+    static __thread struct epoll_event *multi_events[SOCKET_OPS_ZONE_MAX_NUM];
+    static __thread int multi_events_len[SOCKET_OPS_ZONE_MAX_NUM];
+    struct ff_so_context *wait_scs[SOCKET_OPS_ZONE_MAX_NUM];
+    int insts[SOCKET_OPS_ZONE_MAX_NUM];
+    struct ff_so_context *home = sc;
+    int i, k, n = 0, ret, nevents, error;
+    uint32_t mask = route->ep.mask;
+
+    /* Instances in turn get the room left by the division first */
+    for (i = 0; i < SOCKET_OPS_ZONE_MAX_NUM && n < maxevents; i++) {
+        int inst = (route->ep.next + i) & (SOCKET_OPS_ZONE_MAX_NUM - 1);
+        if (mask & (1U << inst)) {
+            insts[n++] = inst;
+        }
+    }
+    if (n == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    route->ep.next = (insts[0] + 1) & (SOCKET_OPS_ZONE_MAX_NUM - 1);
+
+    for (k = 0; k < n; k++) {
+        int inst = insts[k];
+        int room = maxevents / n + (k < maxevents % n);
+
+        wait_scs[k] = ff_instance_sc(inst);
+        if (wait_scs[k] == NULL) {
+            errno = EBADF;
+            return -1;
+        }
+
+        if (multi_args[inst] == NULL) {
+            multi_args[inst] = share_mem_alloc(sizeof(struct ff_epoll_wait_args));
+            if (multi_args[inst] == NULL) {
+                errno = ENOMEM;
+                return -1;
+            }
+        }
+
+        if (multi_events[inst] == NULL || multi_events_len[inst] < room) {
+            if (multi_events[inst]) {
+                share_mem_free(multi_events[inst]);
+            }
+
+            multi_events_len[inst] = room;
+            multi_events[inst] = share_mem_alloc(sizeof(struct epoll_event) * room);
+            if (multi_events[inst] == NULL) {
+                errno = ENOMEM;
+                return -1;
+            }
+        }
+
+        multi_args[inst]->epfd = route->ep.fd[inst];
+        multi_args[inst]->events = multi_events[inst];
+        multi_args[inst]->maxevents = room;
+        multi_args[inst]->timeout = timeout;
+    }
+
+RETRY:
+    for (k = 0; k < n; k++) {
+        struct ff_so_context *sc = wait_scs[k];
+
+        ACQUIRE_ZONE_LOCK(FF_SC_IDLE);
+        sc->ops = FF_SO_EPOLL_WAIT;
+        sc->args = multi_args[insts[k]];
+        sc->result = 0;
+        sc->error = 0;
+        sc->wake_sem = &home->wait_sem;
+        RELEASE_ZONE_LOCK(FF_SC_REQ);
+        ff_so_doorbell(sc);
+    }
+
+    if (timeout <= 0) {
+        need_alarm_sem = 1;
+    }
+
+    nevents = 0;
+#ifdef FF_KERNEL_EVENT
+    if (likely(fstack_kernel_fd_map[ff_epfd] > 0)) {
+        static uint64_t count = 0;
+        if (unlikely((count & 0xff) == 0)) {
+            ret = ff_linux_epoll_wait(fstack_kernel_fd_map[ff_epfd], events, kernel_maxevents, 0);
+            if (ret > 0) {
+                nevents = ret;
+            }
+        }
+        count++;
+    }
+#endif
+
+    errno = 0;
+    if (timeout > 0) {
+        ret = sem_timedwait(&home->wait_sem, abs_timeout);
+    } else {
+        ret = sem_wait(&home->wait_sem);
+    }
+    error = (ret == -1 && errno != ETIMEDOUT) ? errno : 0;
+
+    if (timeout <= 0) {
+        need_alarm_sem = 0;
+    }
+
+    for (k = 0; k < n; k++) {
+        struct ff_so_context *sc = wait_scs[k];
+        struct ff_epoll_wait_args *args = multi_args[insts[k]];
+
+        rte_spinlock_lock(&sc->lock);
+        if (sc->status == FF_SC_REP) {
+            ret = sc->result;
+            if (ret > args->maxevents) {
+                ERR_LOG("return events:%d, maxevents:%d, set return events to maxevents, may be some error occur\n",
+                    ret, args->maxevents);
+                ret = args->maxevents;
+            }
+
+            if (ret > 0) {
+                rte_memcpy(&events[nevents], args->events,
+                    sizeof(struct epoll_event) * ret);
+                nevents += ret;
+            } else if (ret < 0) {
+                error = sc->error;
+            }
+        }
+
+        /* Not replied yet, fstack instance only serves it under lock, so cancel it */
+        sc->wake_sem = NULL;
+        sc->status = FF_SC_IDLE;
+        rte_spinlock_unlock(&sc->lock);
+    }
+
+    /* All replies have been taken, the posts left are theirs */
+    while (sem_trywait(&home->wait_sem) == 0);
+
+    if (nevents > 0) {
+        return nevents;
+    }
+
+    if (error != 0) {
+        errno = error;
+        return -1;
+    }
+
+    /* If timeout is -1, always retry epoll_wait until ret not 0 */
+    if (timeout <= 0) {
+        rte_pause();
+        goto RETRY;
+    }
+
+    return 0;
+}
+#endif
+
 int
 ff_hook_epoll_wait(int epfd, struct epoll_event *events,
     int maxevents, int timeout)
@@ -1735,8 +2551,8 @@ ff_hook_epoll_wait(int epfd, struct epoll_event *events,
     int kernel_ret = 0;
     int kernel_maxevents = kernel_maxevents = maxevents / 16;
 
-    if (kernel_maxevents > SOCKET_OPS_CONTEXT_MAX_NUM) {
-        kernel_maxevents = SOCKET_OPS_CONTEXT_MAX_NUM;
+    if (kernel_maxevents > KERNEL_MAXEVENTS_MAX) {
+        kernel_maxevents = KERNEL_MAXEVENTS_MAX;
     } else if (kernel_maxevents <= 0) {
         kernel_maxevents = 1;
     }
@@ -1772,6 +2588,25 @@ ff_hook_epoll_wait(int epfd, struct epoll_event *events,
         }
     }
 
+#ifdef FF_MULTI_SC
+    struct ff_fd_route *route = fd_routes_nb > 0 ? ff_fd_route_get(epfd) : NULL;
+    if (route != NULL) {
+        if (route->type == FF_ROUTE_EPOLL &&
+            (route->ep.mask & (route->ep.mask - 1))) {
+#ifdef FF_KERNEL_EVENT
+            ret = ff_multi_epoll_wait(route, fd, events, maxevents,
+                kernel_maxevents, timeout, &abs_timeout);
+#else
+            ret = ff_multi_epoll_wait(route, fd, events, maxevents,
+                0, timeout, &abs_timeout);
+#endif
+            ff_fd_route_put(route);
+            return ret;
+        }
+        ff_fd_route_put(route);
+    }
+#endif
+
     args->epfd = fd;
     args->events = sh_events;
     args->maxevents = maxevents;
@@ -1800,6 +2635,7 @@ RETRY:
     }
 
     RELEASE_ZONE_LOCK(FF_SC_REQ);
+    ff_so_doorbell(sc);
 
 #ifdef FF_KERNEL_EVENT
     /*
@@ -1908,11 +2744,28 @@ ff_hook_fork(void)
 
     ERR_LOG("ff_hook_fork\n");
 #ifdef FF_MULTI_SC
-    /* Let the child process inherit the specified sc and ff_so_zone*/
-    sc = scs[current_worker_id].sc;
-    ff_so_zone = ff_so_zones[current_worker_id];
-#endif
+    /*
+     * Child process doesn't inherit any sc, it attaches its own one in each
+     * instance when first used, fds of parent carry their instance.
+     */
+    pid = ff_linux_fork();
+
+    if (pid > 0) {
+        current_worker_id++;
+        ERR_LOG("parent process, chilid pid:%d, current_worker_id++:%d\n",
+            pid, current_worker_id);
+    } else if (pid == 0 && inited) {
+        memset(inst_scs, 0, sizeof(inst_scs));
+        home_inst = current_worker_id % nb_procs;
+        so_spread = 0;
+        sc = ff_instance_sc(home_inst);
+        pthread_setspecific(key, sc);
+        ERR_LOG("chilid process, current_worker_id:%d, home instance:%d, sc:%p\n",
+            current_worker_id, home_inst, sc);
+    }
 
+    return pid;
+#else
     if (sc) {
         rte_spinlock_lock(&sc->lock);
     }
@@ -1925,17 +2778,10 @@ ff_hook_fork(void)
             sc->refcount++;
             ERR_LOG("parent process, chilid pid:%d, sc:%p, sc->refcount:%d, ff_so_zone:%p\n",
                 pid, sc, sc->refcount, ff_so_zone);
-#ifdef FF_MULTI_SC
-            current_worker_id++;
-            ERR_LOG("parent process, current_worker_id++:%d\n", current_worker_id);
-#endif
         }
         else if (pid == 0) {
             ERR_LOG("chilid process, sc:%p, sc->refcount:%d, ff_so_zone:%p\n",
                 sc, sc->refcount, ff_so_zone);
-#ifdef FF_MULTI_SC
-            ERR_LOG("chilid process, current_worker_id:%d\n", current_worker_id);
-#endif
         }
 
         /* Parent process unlock sc, fork success of failed. */
@@ -1945,6 +2791,7 @@ ff_hook_fork(void)
     }
 
     return pid;
+#endif
 }
 
 int
@@ -1959,6 +2806,14 @@ kqueue()
         return -1;
     }
 
+#ifdef FF_MULTI_SC
+    sc = ff_instance_sc(home_inst);
+    if (sc == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+#endif
+
     SYSCALL(FF_SO_KQUEUE, NULL);
 
     if (ret >= 0) {
@@ -1986,6 +2841,8 @@ kevent(int kq, const struct kevent *changelist, int nchanges,
         return -1;
     }
 
+    /* Only the fds in the instance of kq can be changed */
+    ROUTE_FSTACK_FD(kq);
     kq = restore_fstack_fd(kq);
 
     DEFINE_REQ_ARGS_STATIC(kevent);
@@ -2073,6 +2930,7 @@ kevent(int kq, const struct kevent *changelist, int nchanges,
     }
 
     rte_spinlock_unlock(&sc->lock);
+    ff_so_doorbell(sc);
 
     if (timeout != NULL) {
         struct timespec abs_timeout;
@@ -2161,8 +3019,19 @@ static void
 thread_destructor(void *sc)
 {
 #ifdef FF_THREAD_SOCKET
+#ifdef FF_MULTI_SC
+    int i;
+    for (i = 0; i < SOCKET_OPS_ZONE_MAX_NUM; i++) {
+        if (inst_scs[i]) {
+            DEBUG_LOG("pthread self tid:%lu, detach sc:%p\n", pthread_self(), inst_scs[i]);
+            ff_detach_so_context(inst_scs[i]);
+            inst_scs[i] = NULL;
+        }
+    }
+#else
     DEBUG_LOG("pthread self tid:%lu, detach sc:%p\n", pthread_self(), sc);
     ff_detach_so_context(sc);
+#endif
     sc = NULL;
 #endif
 
@@ -2226,6 +3095,14 @@ thread_destructor(void *sc)
     if (kevent_args) {
         share_mem_free(kevent_args);
     }
+#ifdef FF_SO_ZC
+    if (zc_write_args) {
+        share_mem_free(zc_write_args);
+    }
+    if (zc_read_args) {
+        share_mem_free(zc_read_args);
+    }
+#endif
 
     if (sh_iov_static) {
         iovec_share2local_s();
@@ -2241,20 +3118,20 @@ ff_adapter_exit()
 #ifndef FF_THREAD_SOCKET
 
 #ifdef FF_MULTI_SC
-    if (current_worker_id == worker_id) {
-        int i;
-        for (i = 0; i < worker_id; i++) {
-            ERR_LOG("pthread self tid:%lu, detach sc:%p\n", pthread_self(), scs[i].sc);
-            ff_so_zone = ff_so_zones[i];
-            ff_detach_so_context(scs[i].sc);
+    int i;
+    for (i = 0; i < SOCKET_OPS_ZONE_MAX_NUM; i++) {
+        if (inst_scs[i]) {
+            ERR_LOG("pthread self tid:%lu, detach sc:%p\n", pthread_self(), inst_scs[i]);
+            ff_detach_so_context(inst_scs[i]);
+            inst_scs[i] = NULL;
         }
-    } else
-#endif
-    {
-        ERR_LOG("pthread self tid:%lu, detach sc:%p\n", pthread_self(), sc);
-        ff_detach_so_context(sc);
-        sc = NULL;
     }
+    sc = NULL;
+#else
+    ERR_LOG("pthread self tid:%lu, detach sc:%p\n", pthread_self(), sc);
+    ff_detach_so_context(sc);
+    sc = NULL;
+#endif
 #endif
 }
 
@@ -2267,11 +3144,9 @@ ff_adapter_init()
 
     ERR_LOG("inited:%d, proc_inited:%d\n", inited, proc_inited);
 
-#ifndef FF_MULTI_SC
     if (inited) {
         return 0;
     }
-#endif
 
     if (proc_inited == 0) {
         /* May conflict */
@@ -2333,8 +3208,13 @@ ff_adapter_init()
             }
             ERR_LOG("get FF_NB_FSTACK_INSTANCE=%s, use %d\n",
                 ff_nb_procs, nb_procs);
-        }
-        else {
+#ifdef FF_MULTI_SC
+            if (nb_procs > SOCKET_OPS_ZONE_MAX_NUM) {
+                nb_procs = SOCKET_OPS_ZONE_MAX_NUM;
+                ERR_LOG("FF_NB_FSTACK_INSTANCE too large for FF_MULTI_SC, use %d\n", nb_procs);
+            }
+#endif
+        } else {
             ERR_LOG("environment variable FF_NB_FSTACK_INSTANCE not found, to use default value %d\n",
                 nb_procs);
         }
@@ -2400,9 +3280,15 @@ ff_adapter_init()
     pthread_setspecific(key, sc);
 
 #ifdef FF_MULTI_SC
-    scs[worker_id].worker_id = worker_id;
-    scs[worker_id].fd = -1;
-    scs[worker_id].sc = sc;
+    home_inst = worker_id % nb_procs;
+    next_inst = home_inst;
+    inst_scs[home_inst] = sc;
+
+    /* Zones of all instances, for accept balance and children attaching after fork */
+    int i;
+    for (i = 0; i < nb_procs; i++) {
+        ff_lookup_so_zone(i);
+    }
 #endif
     worker_id++;
     inited = 1;
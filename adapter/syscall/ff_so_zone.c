@@ -12,18 +12,12 @@
 #define SOCKET_OPS_CONTEXT_NAME_SIZE 32
 #define SOCKET_OPS_CONTEXT_NAME "ff_so_context_"
 
-static uint16_t ff_max_so_context = SOCKET_OPS_CONTEXT_MAX_NUM;
+static uint16_t ff_max_so_context = SOCKET_OPS_CONTEXT_DEFAULT_NUM;
 __FF_THREAD struct ff_socket_ops_zone *ff_so_zone;
 #ifdef FF_MULTI_SC
-struct ff_socket_ops_zone *ff_so_zones[SOCKET_OPS_CONTEXT_MAX_NUM] = {NULL};
+struct ff_socket_ops_zone *ff_so_zones[SOCKET_OPS_ZONE_MAX_NUM] = {NULL};
 #endif
 
-static inline int
-is_power_of_2(uint64_t n)
-{
-    return (n != 0 && ((n & (n - 1)) == 0));
-}
-
 int
 ff_set_max_so_context(uint16_t count)
 {
@@ -37,9 +31,8 @@ ff_set_max_so_context(uint16_t count)
         return 1;
     }*/
 
-    if (!is_power_of_2(count)) {
-        ERR_LOG("Can not set: count:%d is not power of 2, use default:%d\n",
-            count, ff_max_so_context);
+    if (count == 0) {
+        ERR_LOG("Can not set: count is 0, use default:%d\n", ff_max_so_context);
         return -1;
     }
 
@@ -81,21 +74,32 @@ ff_create_so_memzone()
             memset(mz->addr, 0, zone_size);
             so_zone_tmp = mz->addr;
 
-            rte_spinlock_init(&so_zone_tmp->lock);
             so_zone_tmp->count = ff_max_so_context;
-            so_zone_tmp->mask = so_zone_tmp->count - 1;
             so_zone_tmp->free = so_zone_tmp->count;
             so_zone_tmp->idx = 0;
-            memset(so_zone_tmp->inuse, 0, SOCKET_OPS_CONTEXT_MAX_NUM);
+            so_zone_tmp->proc_id = proc_id;
             so_zone_tmp->sc = (struct ff_so_context *)(so_zone_tmp + 1);
 
+            /* Bits past count stay set, never attached */
+            for (i = 0; i < FF_SO_BITMAP_WORDS; i++) {
+                uint16_t base = i << 6;
+                if (base + 64 <= ff_max_so_context) {
+                    so_zone_tmp->inuse[i] = 0;
+                } else if (base < ff_max_so_context) {
+                    so_zone_tmp->inuse[i] = ~0ULL << (ff_max_so_context - base);
+                } else {
+                    so_zone_tmp->inuse[i] = ~0ULL;
+                }
+            }
+
             for (i = 0; i < ff_max_so_context; i++) {
                 struct ff_so_context *sc = &so_zone_tmp->sc[i];
                 rte_spinlock_init(&sc->lock);
+                rte_spinlock_init(&sc->sq_lock);
                 sc->status = FF_SC_IDLE;
                 sc->idx = i;
                 sc->refcount = 0;
-                //so_zone_tmp->inuse[i] = 0;
+                sc->zone = so_zone_tmp;
 
                 if (sem_init(&sc->wait_sem, 1, 0) == -1) {
                     ERR_LOG("Initialize semaphore failed:%d\n", errno);
@@ -126,14 +130,88 @@ ff_create_so_memzone()
     return 0;
 }
 
+/*
+ * Take a free so_context by setting its bit in zone->inuse with CAS,
+ * starting from the word that last had a free one.
+ */
+static struct ff_so_context *
+ff_so_context_alloc(struct ff_socket_ops_zone *zone)
+{
+    uint16_t i, w, nb_words = (zone->count + 63) >> 6;
+    uint64_t old, bit;
+
+    for (i = 0; i < nb_words; i++) {
+        w = (zone->idx + i) % nb_words;
+        old = zone->inuse[w];
+        while (~old) {
+            bit = ~old & (old + 1);
+            if (__atomic_compare_exchange_n(&zone->inuse[w], &old, old | bit,
+                0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+                __atomic_fetch_sub(&zone->free, 1, __ATOMIC_RELAXED);
+                zone->idx = w;
+                return &zone->sc[(w << 6) + __builtin_ctzll(bit)];
+            }
+            /* old is reloaded by the failed CAS */
+        }
+    }
+
+    return NULL;
+}
+
+static void
+ff_so_context_free(struct ff_socket_ops_zone *zone, struct ff_so_context *sc)
+{
+    uint64_t bit = 1ULL << (sc->idx & 63);
+
+    if (__atomic_fetch_and(&zone->inuse[sc->idx >> 6], ~bit,
+        __ATOMIC_RELEASE) & bit) {
+        __atomic_fetch_add(&zone->free, 1, __ATOMIC_RELAXED);
+        zone->idx = sc->idx >> 6;
+    }
+}
+
+#ifdef FF_MULTI_SC
+/* Zone of fstack instance idx, looked up once per process */
+struct ff_socket_ops_zone *
+ff_lookup_so_zone(int idx)
+{
+    const struct rte_memzone *mz;
+    char zn[64];
+
+    if (idx < 0 || idx >= SOCKET_OPS_ZONE_MAX_NUM) {
+        return NULL;
+    }
+
+    if (ff_so_zones[idx] != NULL) {
+        return ff_so_zones[idx];
+    }
+
+    snprintf(zn, sizeof(zn), SOCKET_OPS_ZONE_NAME, idx);
+    ERR_LOG("To lookup memzone:%s\n", zn);
+
+    mz = rte_memzone_lookup(zn);
+    if (mz == NULL) {
+        ERR_LOG("Lookup memory zone:%s failed\n", zn);
+        return NULL;
+    }
+
+    ff_so_zones[idx] = mz->addr;
+    ERR_LOG("FF_MULTI_SC f_so_zones[%d]:%p\n", idx, ff_so_zones[idx]);
+
+    return ff_so_zones[idx];
+}
+#endif
+
 struct ff_so_context *
 ff_attach_so_context(int idx)
 {
     struct ff_so_context *sc = NULL;
-    uint16_t i;
 
 #ifdef FF_MULTI_SC
-    ff_so_zone = ff_so_zones[idx];
+    ff_so_zone = ff_lookup_so_zone(idx);
+    if (ff_so_zone == NULL) {
+        return NULL;
+    }
 #endif
 
     DEBUG_LOG("proc_id:%d, ff_so_zone:%p\n", idx, ff_so_zone);
@@ -152,46 +230,26 @@ ff_attach_so_context(int idx)
         }
 
         ff_so_zone = mz->addr;
-
-#ifdef FF_MULTI_SC
-        ff_so_zones[idx] = ff_so_zone;
-        ERR_LOG("FF_MULTI_SC f_so_zones[%d]:%p\n", idx, ff_so_zones[idx]);
-#endif
     }
 
-    rte_spinlock_lock(&ff_so_zone->lock);
-
-    if (ff_so_zone->free == 0) {
-        ERR_LOG("Attach memzone failed: no free context\n");
-        rte_spinlock_unlock(&ff_so_zone->lock);
-        return NULL;
-    }
-
-    for (i = 0; i < ff_so_zone->count; i++) {
-        uint16_t idx = (ff_so_zone->idx + i) & ff_so_zone->mask;
-        sc = &ff_so_zone->sc[idx];
-        if (ff_so_zone->inuse[idx] == 0) {
-            ff_so_zone->inuse[idx] = 1;
-            rte_spinlock_init(&sc->lock);
-            sc->status = FF_SC_IDLE;
-            sc->refcount = 1;
-            ff_so_zone->free--;
-            ff_so_zone->idx = idx + 1;
-            break;
-        }
-    }
-
-    if (unlikely(i == ff_so_zone->count)) {
-        ERR_LOG("Attach memzone failed: instance %d no free context,"
-            " fetel error of so status, all sc inuse, count:%d, free:%d\n",
+    sc = ff_so_context_alloc(ff_so_zone);
+    if (sc == NULL) {
+        ERR_LOG("Attach memzone failed: instance %d no free context, count:%d, free:%d\n",
             idx, ff_so_zone->count, ff_so_zone->free);
-        sc = NULL;
+        return NULL;
     }
 
-    ERR_LOG("attach sc:%p, so count:%d, free:%d, idx:%d, i:%d\n",
-        sc, ff_so_zone->count, ff_so_zone->free, ff_so_zone->idx, i);
+    /*
+     * The bit is ours now, a stale pending bit only finds an idle sc.
+     * The rings are left empty by detach, their indexes just keep running.
+     */
+    sc->status = FF_SC_IDLE;
+    sc->wake_sem = NULL;
+    sc->refcount = 1;
+    rte_smp_wmb();
 
-    rte_spinlock_unlock(&ff_so_zone->lock);
+    ERR_LOG("attach sc:%p, so count:%d, free:%d, idx:%d\n",
+        sc, ff_so_zone->count, ff_so_zone->free, sc->idx);
 
     return sc;
 }
@@ -199,36 +257,47 @@ ff_attach_so_context(int idx)
 void
 ff_detach_so_context(struct ff_so_context *sc)
 {
+    struct ff_socket_ops_zone *zone;
+
     ERR_LOG("ff_so_zone:%p, sc:%p\n", ff_so_zone, sc);
 
     if (ff_so_zone == NULL || sc == NULL) {
         return;
     }
+    zone = sc->zone;
 
     ERR_LOG("detach sc:%p, ops:%d, status:%d, idx:%d, sc->refcount:%d, inuse:%d, so free:%u, idx:%u\n",
-        sc, sc->ops, sc->status, sc->idx, sc->refcount, ff_so_zone->inuse[sc->idx], ff_so_zone->free, ff_so_zone->idx);
+        sc, sc->ops, sc->status, sc->idx, sc->refcount, ff_so_context_inuse(zone, sc->idx), zone->free, zone->idx);
+
+    /*
+     * Wait for the fstack instance to drain the queued ops before giving
+     * the context back, completions are dropped since nobody will reap them.
+     */
+    if (sc->refcount <= 1) {
+        while (sc->sq_head != sc->sq_tail) {
+            sc->cq_head = sc->cq_tail;
+            rte_pause();
+        }
+        sc->cq_head = sc->cq_tail;
+    }
 
-    rte_spinlock_lock(&ff_so_zone->lock);
     rte_spinlock_lock(&sc->lock);
 
     if (sc->refcount > 1) {
-        ERR_LOG("sc refcount > 1, to sub it, sc:%p, ops:%d, status:%d, idx:%d, sc->refcount:%d, inuse:%d, so free:%u, idx:%u\n",
-                sc, sc->ops, sc->status, sc->idx, sc->refcount, ff_so_zone->inuse[sc->idx], ff_so_zone->free, ff_so_zone->idx);
+        ERR_LOG("sc refcount > 1, to sub it, sc:%p, ops:%d, status:%d, idx:%d, sc->refcount:%d\n",
+                sc, sc->ops, sc->status, sc->idx, sc->refcount);
         sc->refcount--;
+        rte_spinlock_unlock(&sc->lock);
     } else {
-        ERR_LOG("sc refcount is 1, to detach it, sc:%p, ops:%d, status:%d, idx:%d, sc->refcount:%d, inuse:%d, so free:%u, idx:%u\n",
-                sc, sc->ops, sc->status, sc->idx, sc->refcount, ff_so_zone->inuse[sc->idx], ff_so_zone->free, ff_so_zone->idx);
-        if (ff_so_zone->inuse[sc->idx] == 1) {
-            ff_so_zone->inuse[sc->idx] = 0;
+        ERR_LOG("sc refcount is 1, to detach it, sc:%p, ops:%d, status:%d, idx:%d, sc->refcount:%d\n",
+                sc, sc->ops, sc->status, sc->idx, sc->refcount);
+        sc->refcount = 0;
+        rte_spinlock_unlock(&sc->lock);
 
-            ff_so_zone->free++;
-            ff_so_zone->idx = sc->idx;
-        }
+        /* Unlock first, the sc may be attached by others at once */
+        ff_so_context_free(zone, sc);
     }
 
-    ERR_LOG("detach sc:%p, ops:%d, status:%d, idx:%d, sc->refcount:%d, inuse:%d, so free:%u, idx:%u\n",
-        sc, sc->ops, sc->status, sc->idx, sc->refcount, ff_so_zone->inuse[sc->idx], ff_so_zone->free, ff_so_zone->idx);
-
-    rte_spinlock_unlock(&sc->lock);
-    rte_spinlock_unlock(&ff_so_zone->lock);
+    ERR_LOG("detach sc:%p, idx:%d, inuse:%d, so free:%u, idx:%u\n",
+        sc, sc->idx, ff_so_context_inuse(zone, sc->idx), zone->free, zone->idx);
 }
@@ -1,4 +1,6 @@
+#include <rte_malloc.h>
 #include <rte_memcpy.h>
+#include <rte_memory.h>
 #include <rte_spinlock.h>
 
 #include "ff_socket_ops.h"
@@ -13,81 +15,69 @@
 #include <ff_declare_syscalls.h>
 static int ff_sys_kqueue(struct ff_kqueue_args *args);
 static int ff_sys_kevent(struct ff_kevent_args *args);
-
-#define FF_MAX_BOUND_NUM 8
+static ssize_t ff_sys_zc_write(struct ff_zc_write_args *args);
+static ssize_t ff_sys_zc_read(struct ff_zc_read_args *args);
+static int ff_sys_zc_free(struct ff_zc_free_args *args);
 
 /* Where to call sem_post in kevent or epoll_wait */
 static int sem_flag = 0;
 
 /*
- * The event num kevent or epoll_wait returned.
- * Use for burst process event in one F-Stack loop to improve performance.
+ * Slot + 1 of the bound table entry of fd, 0 if fd is not bound.
+ * Keeps close and accept off the table, which is keyed by address.
+ * Fds of F-Stack are below kern.maxfiles, no more than 65536.
  */
-#define EVENT_LOOP_TIMES    32
-static int ff_event_loop_nb = 0;
-//static int ff_next_event_flag = 0;
+#define FF_BOUND_FD_MAX 65536
+static uint8_t ff_bound_slot[FF_BOUND_FD_MAX];
 
-struct ff_bound_info {
-    int fd;
-    struct sockaddr addr;
-};
+/* Values of FreeBSD, for ff_getsockopt_freebsd() */
+#define FREEBSD_SOL_SOCKET      0xffff
+#define FREEBSD_SO_LISTENQLEN   0x1012
 
-static struct ff_bound_info ff_bound_fds[FF_MAX_BOUND_NUM];
+/* Loops between two refreshes of qlen of the bound sockets */
+#define FF_BOUND_REFRESH_LOOPS 1024
 
-static int
-sockaddr_cmp(struct sockaddr *a, struct sockaddr *b)
+static struct ff_bound_info *
+sockaddr_bound_info(int fd)
 {
-    struct sockaddr_in *sina, *sinb;
-    sina = (struct sockaddr_in *)a;
-    sinb = (struct sockaddr_in *)b;
-
-    if (sina->sin_family != sinb->sin_family) {
-        return 1;
-    }
-
-    if (sina->sin_port != sinb->sin_port) {
-        return 1;
-    }
-
-    if (sina->sin_addr.s_addr != sinb->sin_addr.s_addr) {
-        return 1;
+    if (fd < 0 || fd >= FF_BOUND_FD_MAX || ff_bound_slot[fd] == 0) {
+        return NULL;
     }
 
-    return 0;
+    return &ff_so_zone->bound[ff_bound_slot[fd] - 1];
 }
 
 static int
 sockaddr_is_bound(struct sockaddr *addr)
 {
-    int i;
-
-    for (i = 0; i < FF_MAX_BOUND_NUM; i++) {
-        struct ff_bound_info *info = &ff_bound_fds[i];
-        if (info->fd == 0) {
-            continue;
-        }
-
-        if (sockaddr_cmp(&info->addr, addr) == 0) {
-            return info->fd;
-        }
-    }
+    struct ff_bound_info *info = ff_bound_lookup(ff_so_zone, addr);
 
-    return 0;
+    return info ? info->fd : -1;
 }
 
 static int
 sockaddr_bind(int fd, struct sockaddr *addr)
 {
-    int i;
+    uint32_t i, slot;
 
-    for (i = 0; i < FF_MAX_BOUND_NUM; i++) {
-        struct ff_bound_info *info = &ff_bound_fds[i];
-        if (info->fd != 0) {
+    if (fd < 0 || fd >= FF_BOUND_FD_MAX) {
+        return -1;
+    }
+
+    slot = ff_bound_addr_hash(addr);
+    for (i = 0; i < FF_MAX_BOUND_NUM; i++, slot++) {
+        struct ff_bound_info *info = &ff_so_zone->bound[slot & FF_BOUND_MASK];
+        if (info->state == FF_BOUND_USED) {
             continue;
         }
 
         info->fd = fd;
-        rte_memcpy(&info->addr, addr, sizeof(struct sockaddr));
+        info->qlen = 0;
+        rte_memcpy(&info->addr, addr, ff_bound_addr_len(addr));
+        /* APP may look it up now */
+        rte_smp_wmb();
+        info->state = FF_BOUND_USED;
+        ff_bound_slot[fd] = (slot & FF_BOUND_MASK) + 1;
 
         return 0;
     }
@@ -98,20 +88,41 @@ sockaddr_bind(int fd, struct sockaddr *addr)
 static int
 sockaddr_unbind(int fd)
 {
-    int i;
+    struct ff_bound_info *info = sockaddr_bound_info(fd);
 
-    for (i = 0; i < FF_MAX_BOUND_NUM; i++) {
-        struct ff_bound_info *info = &ff_bound_fds[i];
-        if (info->fd != fd) {
-            continue;
-        }
+    if (info == NULL) {
+        return -1;
+    }
 
-        info->fd = 0;
+    info->state = FF_BOUND_DELETED;
+    ff_bound_slot[fd] = 0;
 
-        return 0;
+    return 0;
+}
+
+static void
+sockaddr_bound_refresh(struct ff_bound_info *info)
+{
+    int qlen = 0;
+    socklen_t optlen = sizeof(qlen);
+
+    if (ff_getsockopt_freebsd(info->fd, FREEBSD_SOL_SOCKET,
+        FREEBSD_SO_LISTENQLEN, &qlen, &optlen) == 0) {
+        info->qlen = qlen;
     }
+}
 
-    return -1;
+static void
+sockaddr_bound_refresh_all(void)
+{
+    int i;
+
+    for (i = 0; i < FF_MAX_BOUND_NUM; i++) {
+        struct ff_bound_info *info = &ff_so_zone->bound[i];
+        if (info->state == FF_BOUND_USED) {
+            sockaddr_bound_refresh(info);
+        }
+    }
 }
 
 static int
@@ -127,7 +138,7 @@ ff_sys_bind(struct ff_bind_args *args)
     int ret;
 
     bound_fd = sockaddr_is_bound(args->addr);
-    if (bound_fd != 0 && bound_fd != args->fd) {
+    if (bound_fd >= 0 && bound_fd != args->fd) {
         return ff_dup2(bound_fd, args->fd);
     }
 
@@ -180,7 +191,18 @@ ff_sys_setsockopt(struct ff_setsockopt_args *args)
 static int
 ff_sys_accept(struct ff_accept_args *args)
 {
-    return ff_accept(args->fd, args->addr, args->addrlen);
+    struct ff_bound_info *info;
+    int ret;
+
+    ret = ff_accept(args->fd, args->addr, args->addrlen);
+
+    /* Keep qlen fresh for APP balancing accept between instances */
+    info = sockaddr_bound_info(args->fd);
+    if (info != NULL) {
+        sockaddr_bound_refresh(info);
+    }
+
+    return ret;
 }
 
 static int
@@ -359,6 +381,104 @@ ff_sys_fork(struct ff_fork_args *args)
     return -1;
 }
 
+/*
+ * Attach the APP buffer to the socket buffer by reference,
+ * it is freed by ff_zc_reclaim() when the socket buffer released it.
+ */
+static ssize_t
+ff_sys_zc_write(struct ff_zc_write_args *args)
+{
+    struct ff_zc_mbuf zm;
+
+    if (ff_zc_mbuf_attach(&zm, args->buf, args->len,
+        (uint64_t)(uintptr_t)args->buf) < 0) {
+        rte_free(args->buf);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    return ff_zc_send(args->fd, &zm, args->flags);
+}
+
+/*
+ * Lend the received mbuf chain to APP if all the data areas are in DPDK
+ * memory that APP has mapped too, i.e. rte_mbufs, or clusters with
+ * freebsd.boot hugepage_mem. Otherwise copy it out as ff_read does.
+ */
+static ssize_t
+ff_sys_zc_read(struct ff_zc_read_args *args)
+{
+    struct ff_zc_mbuf zm;
+    const char *data;
+    ssize_t ret;
+    int len, shared = 1;
+
+    args->mbuf = NULL;
+    args->iovcnt = 0;
+
+    ret = ff_zc_recv(args->fd, &zm, args->len, args->flags);
+    if (ret <= 0) {
+        return ret;
+    }
+
+    while ((len = ff_zc_mbuf_read(&zm, &data)) > 0) {
+        if (args->iovcnt == FF_ZC_IOV_MAX ||
+            rte_mem_virt2memseg_list(data) == NULL) {
+            shared = 0;
+            break;
+        }
+        args->iov[args->iovcnt].iov_base = (void *)data;
+        args->iov[args->iovcnt].iov_len = len;
+        args->iovcnt++;
+    }
+
+    if (shared) {
+        args->mbuf = zm.bsd_mbuf;
+        return ret;
+    }
+
+    args->iovcnt = 0;
+    zm.bsd_mbuf_off = zm.bsd_mbuf;
+    zm.off = 0;
+    ret = 0;
+    while ((len = ff_zc_mbuf_read(&zm, &data)) > 0) {
+        rte_memcpy((char *)args->buf + ret, data, len);
+        ret += len;
+    }
+    ff_zc_mbuf_free(&zm);
+
+    return ret;
+}
+
+static int
+ff_sys_zc_free(struct ff_zc_free_args *args)
+{
+    struct ff_zc_mbuf zm = {
+        .bsd_mbuf = args->mbuf,
+    };
+
+    ff_zc_mbuf_free(&zm);
+
+    return 0;
+}
+
+#define ZC_RECLAIM_BURST 32
+
+/* Free the buffers of FF_SO_ZC_WRITE released by the socket buffers */
+static void
+ff_zc_reclaim(void)
+{
+    uint64_t cookies[ZC_RECLAIM_BURST];
+    int i, n;
+
+    do {
+        n = ff_zc_completions(cookies, ZC_RECLAIM_BURST);
+        for (i = 0; i < n; i++) {
+            rte_free((void *)(uintptr_t)cookies[i]);
+        }
+    } while (n == ZC_RECLAIM_BURST);
+}
+
 static int
 ff_so_handler(int ops, void *args)
 {
@@ -424,6 +544,12 @@ ff_so_handler(int ops, void *args)
             return ff_sys_kevent((struct ff_kevent_args *)args);
         case FF_SO_FORK:
             return ff_sys_fork((struct ff_fork_args *)args);
+        case FF_SO_ZC_WRITE:
+            return ff_sys_zc_write((struct ff_zc_write_args *)args);
+        case FF_SO_ZC_READ:
+            return ff_sys_zc_read((struct ff_zc_read_args *)args);
+        case FF_SO_ZC_FREE:
+            return ff_sys_zc_free((struct ff_zc_free_args *)args);
         default:
             break;
     }
@@ -433,6 +559,47 @@ ff_so_handler(int ops, void *args)
     return (-1);
 }
 
+/*
+ * Run all queued ops of the submission ring in one pass,
+ * stop early if the APP has not reaped the completion ring.
+ */
+static inline void
+ff_handle_submit_ring(struct ff_so_context *sc)
+{
+    uint32_t sq_head = sc->sq_head;
+    uint32_t sq_tail = sc->sq_tail;
+    uint32_t cq_tail = sc->cq_tail;
+
+    if (sq_head == sq_tail) {
+        return;
+    }
+
+    /* Read entries after the tail published by APP */
+    rte_smp_rmb();
+
+    while (sq_head != sq_tail &&
+        cq_tail - sc->cq_head < FF_SO_RING_SIZE) {
+        struct ff_so_sqe *sqe = &sc->sq[sq_head & FF_SO_RING_MASK];
+        struct ff_so_cqe *cqe = &sc->cq[cq_tail & FF_SO_RING_MASK];
+
+        DEBUG_LOG("ff_handle_submit_ring sc:%p, ops:%d, sq_head:%u, sq_tail:%u\n",
+            sc, sqe->ops, sq_head, sq_tail);
+
+        errno = 0;
+        cqe->result = ff_so_handler(sqe->ops, &sqe->args);
+        cqe->error = errno;
+        cqe->ops = sqe->ops;
+        cqe->user_data = sqe->user_data;
+
+        sq_head++;
+        cq_tail++;
+    }
+
+    rte_smp_wmb();
+    sc->cq_tail = cq_tail;
+    sc->sq_head = sq_head;
+}
+
 static inline void
 ff_handle_socket_ops(struct ff_so_context *sc)
 {
@@ -445,6 +612,9 @@ ff_handle_socket_ops(struct ff_so_context *sc)
         return;
     }
 
+    /* Ops queued before this request must be seen by it */
+    ff_handle_submit_ring(sc);
+
     DEBUG_LOG("ff_handle_socket_ops sc:%p, status:%d, ops:%d\n", sc, sc->status, sc->ops);
 
     errno = 0;
@@ -453,23 +623,9 @@ ff_handle_socket_ops(struct ff_so_context *sc)
     DEBUG_LOG("ff_handle_socket_ops error:%d, ops:%d, result:%d\n", errno, sc->ops, sc->result);
 
     if (sc->ops == FF_SO_EPOLL_WAIT || sc->ops == FF_SO_KEVENT) {
-        /*DEBUG_LOG("ff_event_loop_nb:%d, ff_next_event_flag:%d\n",
-                   ff_event_loop_nb, ff_next_event_flag);
-        if (ff_event_loop_nb > 0) {
-            ff_next_event_flag = 1;
-        } else {
-            ff_next_event_flag = 0;
-        }
-
-        if (sc->result > 0) {
-            ff_event_loop_nb = (sc->result * EVENT_LOOP_TIMES);
-        } else {
-            ff_event_loop_nb = 0;
-        }*/
-
         if (sem_flag == 1) {
             sc->status = FF_SC_REP;
-            sem_post(&sc->wait_sem);
+            sem_post(sc->wake_sem ? sc->wake_sem : &sc->wait_sem);
         } else {
             // do nothing with this sc
         }
@@ -480,74 +636,70 @@ ff_handle_socket_ops(struct ff_so_context *sc)
     rte_spinlock_unlock(&sc->lock);
 }
 
+/*
+ * Serve the sc that rang the doorbell, and only them.
+ * Never wait for APP, so the network loop keeps polling NICs and timers.
+ */
 void
 ff_handle_each_context()
 {
-    uint16_t i, nb_handled, tmp;
+    uint16_t i, w, nb_words;
+    uint64_t bits, rearm;
     static uint64_t loop_count = 0;
-    static uint64_t cur_tsc, diff_tsc, drain_tsc = 0;
 
-    if (unlikely(drain_tsc == 0 && ff_global_cfg.dpdk.pkt_tx_delay)) {
-        drain_tsc = (rte_get_tsc_hz() + US_PER_S - 1) / US_PER_S * ff_global_cfg.dpdk.pkt_tx_delay;
-        ERR_LOG("ff_global_cfg.dpdk.handle_sc_delay%d, drain_tsc:%lu\n",
-                        ff_global_cfg.dpdk.pkt_tx_delay, drain_tsc);
-    }
-
-    ff_event_loop_nb = 0;
+    loop_count++;
 
-    cur_tsc = rte_rdtsc();
+    /* Only the words of count, at most one cache line per 512 sc */
+    nb_words = (ff_so_zone->count + 63) >> 6;
 
-    rte_spinlock_lock(&ff_so_zone->lock);
+    for (w = 0; w < nb_words; w++) {
+        if (ff_so_zone->pending[w] == 0) {
+            continue;
+        }
 
-    assert(ff_so_zone->count >= ff_so_zone->free);
-    tmp = nb_handled = ff_so_zone->count - ff_so_zone->free;
+        bits = __atomic_exchange_n(&ff_so_zone->pending[w], 0, __ATOMIC_ACQUIRE);
+        rearm = 0;
 
-    while(1) {
-        nb_handled = tmp;
-        if (nb_handled) {
-            for (i = 0; i < ff_so_zone->count; i++) {
-                struct ff_so_context *sc = &ff_so_zone->sc[i];
+        while (bits) {
+            uint64_t bit = bits & -bits;
+            struct ff_so_context *sc;
 
-                if ((loop_count & 1048575) == 0) {
-                    DEBUG_LOG("so:%p, so->count:%d,%p, sc:%p, sc->inuse:%d,%p, i:%d, nb:%d, all_nb:%d\n",
-                        ff_so_zone, ff_so_zone->count, &ff_so_zone->count,
-                        sc, ff_so_zone->inuse[i], &ff_so_zone->inuse[i], i, nb_handled, tmp);
-                }
+            bits ^= bit;
+            i = (w << 6) + __builtin_ctzll(bit);
+            if (!ff_so_context_inuse(ff_so_zone, i)) {
+                continue;
+            }
+            sc = &ff_so_zone->sc[i];
 
-                if (ff_so_zone->inuse[i] == 0) {
-                    continue;
-                }
+            /* Dirty read first, and then try to lock sc and real read. */
+            if (sc->status == FF_SC_REQ) {
+                ff_handle_socket_ops(sc);
+            } else {
+                ff_handle_submit_ring(sc);
+            }
 
-                /* Dirty read first, and then try to lock sc and real read. */
-                if (sc->status == FF_SC_REQ) {
-                    ff_handle_socket_ops(sc);
-                }
+            /*
+             * Still something to do, e.g. epoll_wait without event,
+             * sc locked by APP or completion ring full, serve it next loop.
+             */
+            if (sc->status == FF_SC_REQ || sc->sq_head != sc->sq_tail) {
+                rearm |= bit;
+            }
 
-                nb_handled--;
-                if (!nb_handled) {
-                    break;
-                }
+            if ((loop_count & 1048575) == 0) {
+                DEBUG_LOG("so:%p, sc:%p, i:%d, status:%d, rearm:%lx\n",
+                    ff_so_zone, sc, i, sc->status, rearm);
             }
         }
 
-        /*if (--ff_event_loop_nb <= 0 || ff_next_event_flag == 1) {
-            break;
-        }*/
-        diff_tsc = rte_rdtsc() - cur_tsc;
-        DEBUG_LOG("cur_tsc:%lu, diff_tsc:%lu, drain_tsc:%lu\n", cur_tsc, diff_tsc, drain_tsc);
-        if (diff_tsc >= drain_tsc) {
-            break;
+        if (rearm) {
+            __atomic_fetch_or(&ff_so_zone->pending[w], rearm, __ATOMIC_RELAXED);
         }
-
-        rte_pause();
     }
 
-    rte_spinlock_unlock(&ff_so_zone->lock);
-
-    loop_count++;
+    if ((loop_count % FF_BOUND_REFRESH_LOOPS) == 0) {
+        sockaddr_bound_refresh_all();
+    }
 
-    DEBUG_LOG("loop_count:%lu, nb:%d, all_nb:%d\n",
-        loop_count, nb_handled, tmp/*, ff_event_loop_nb, ff_next_event_flag*/);
-    //, ff_event_loop_nb:%d, ff_next_event_flag:%d
+    ff_zc_reclaim();
 }
-
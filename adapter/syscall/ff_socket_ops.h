@@ -2,11 +2,15 @@
 #define _FF_SOCKET_OPS_H_
 
 #include <unistd.h>
+#include <string.h>
 #include <semaphore.h>
+#include <netinet/in.h>
 
 #include <rte_atomic.h>
 #include <rte_spinlock.h>
 
+#include "ff_sysproto.h"
+
 /*
  * Per thread separate initialization dpdk lib and attach sc when needed,
  * such as listen same port in different threads, and socket can use in own thread.
@@ -30,8 +34,19 @@
 #define DEBUG_LOG ERR_LOG
 #endif
 
-/* Must be power of 2 */
-#define SOCKET_OPS_CONTEXT_MAX_NUM (1 << 5)
+/* Upper limit of so_context per fstack instance, see ff_set_max_so_context() */
+#define SOCKET_OPS_CONTEXT_MAX_NUM (1 << 10)
+#define SOCKET_OPS_CONTEXT_DEFAULT_NUM (1 << 5)
+
+/*
+ * Max fstack instances one APP can attach to, with FF_MULTI_SC.
+ * The instance is kept in the low bits of the fd returned to APP.
+ */
+#define SOCKET_OPS_ZONE_SHIFT 5
+#define SOCKET_OPS_ZONE_MAX_NUM (1 << SOCKET_OPS_ZONE_SHIFT)
+
+/* Words of the inuse and pending bitmaps, one bit per so_context */
+#define FF_SO_BITMAP_WORDS ((SOCKET_OPS_CONTEXT_MAX_NUM + 63) / 64)
 
 enum FF_SOCKET_OPS {
     FF_SO_SOCKET,
@@ -64,6 +79,48 @@ enum FF_SOCKET_OPS {
     FF_SO_KQUEUE,
     FF_SO_KEVENT,
     FF_SO_FORK, // 29
+    FF_SO_ZC_WRITE,
+    FF_SO_ZC_READ,
+    FF_SO_ZC_FREE,
+};
+
+/* Max segments of the mbuf chain lent by FF_SO_ZC_READ */
+#define FF_ZC_IOV_MAX 64
+
+/*
+ * Entries of the per context submission/completion rings, must be power of 2.
+ *
+ * Ops that the APP does not need to wait for (close, epoll_ctl, zc free) are queued
+ * in the submission ring and drained in bulk by the fstack instance on every
+ * loop, without a round trip through sc->status.
+ */
+#define FF_SO_RING_SIZE 64
+#define FF_SO_RING_MASK (FF_SO_RING_SIZE - 1)
+
+/* Slots of the bound address table of one fstack instance, must be power of 2 */
+#define FF_MAX_BOUND_NUM 64
+#define FF_BOUND_MASK (FF_MAX_BOUND_NUM - 1)
+
+enum FF_BOUND_STATE {
+    FF_BOUND_EMPTY,
+    FF_BOUND_USED,
+    FF_BOUND_DELETED,
+};
+
+/*
+ * Address bound by a socket of fstack instance, so that the same address
+ * bound again (e.g. by every worker of nginx) gets the same socket.
+ *
+ * Written by fstack instance only. APP reads qlen of the listen sockets
+ * bound to one address in every instance to balance accept, with FF_MULTI_SC.
+ */
+struct ff_bound_info {
+    volatile int state;
+    int fd;
+    /* complete connections not accepted yet, refreshed by fstack instance */
+    volatile int qlen;
+    /* sockaddr_in or sockaddr_in6 */
+    struct sockaddr_in6 addr;
 };
 
 enum FF_SO_CONTEXT_STATUS {
@@ -73,24 +130,56 @@ enum FF_SO_CONTEXT_STATUS {
 };
 
 struct ff_socket_ops_zone {
-    rte_spinlock_t lock;
-
-    /* total number of so_contex, must be power of 2 */
-    uint8_t count;
-    uint8_t mask;
+    /* total number of so_contex */
+    uint16_t count;
 
     /* free number of so_context */
-    uint8_t free;
+    volatile uint16_t free;
+
+    /* word of inuse to search first */
+    volatile uint16_t idx;
 
-    uint8_t idx;
+    /* fstack instance of the zone */
+    uint16_t proc_id;
 
-    /* 1 if used, else 0, most access */
-    uint8_t inuse[SOCKET_OPS_CONTEXT_MAX_NUM];
     struct ff_so_context *sc;
 
-    uint8_t padding[16];
+    /*
+     * Bit set if used, else 0. Attach and detach take and give back
+     * the bit with atomic ops, no lock.
+     */
+    volatile uint64_t inuse[FF_SO_BITMAP_WORDS];
+
+    /*
+     * Doorbell, APP sets the bit of its sc after posting a request or
+     * queuing ops, and fstack instance only serves the flagged sc.
+     * Own cache line, it is read by fstack instance in every loop.
+     */
+    volatile uint64_t pending[FF_SO_BITMAP_WORDS] __attribute__((aligned(RTE_CACHE_LINE_SIZE)));
+
+    /* Open addressing hash table, keyed by address */
+    struct ff_bound_info bound[FF_MAX_BOUND_NUM] __attribute__((aligned(RTE_CACHE_LINE_SIZE)));
 } __attribute__((aligned(RTE_CACHE_LINE_SIZE)));
 
+/* Submission queue entry, args are copied inline to the shared memzone */
+struct ff_so_sqe {
+    enum FF_SOCKET_OPS ops;
+    uint64_t user_data;
+    union {
+        struct ff_close_args close;
+        struct ff_epoll_ctl_args epoll_ctl;
+        struct ff_zc_free_args zc_free;
+    } args;
+};
+
+/* Completion queue entry */
+struct ff_so_cqe {
+    enum FF_SOCKET_OPS ops;
+    int result;
+    int error;
+    uint64_t user_data;
+};
+
 struct ff_so_context {
     /* CACHE LINE 0 */
     enum FF_SOCKET_OPS ops;
@@ -110,11 +199,110 @@ struct ff_so_context {
     /* CACHE LINE 1 */
     /* listen fd, refcount.. */
     int refcount;
+    struct ff_socket_ops_zone *zone;
+
+    /*
+     * Posted instead of wait_sem if set, APP waiting on several
+     * instances at once points them all to one semaphore.
+     */
+    sem_t *wake_sem;
+
+    /* CACHE LINE 2, written by APP */
+    rte_spinlock_t sq_lock;
+    volatile uint32_t sq_tail;
+    volatile uint32_t cq_head;
+
+    /* CACHE LINE 3, written by fstack instance */
+    volatile uint32_t sq_head __attribute__((aligned(RTE_CACHE_LINE_SIZE)));
+    volatile uint32_t cq_tail;
+
+    struct ff_so_sqe sq[FF_SO_RING_SIZE] __attribute__((aligned(RTE_CACHE_LINE_SIZE)));
+    struct ff_so_cqe cq[FF_SO_RING_SIZE] __attribute__((aligned(RTE_CACHE_LINE_SIZE)));
 } __attribute__((aligned(RTE_CACHE_LINE_SIZE)));
 
+static inline int
+ff_so_context_inuse(struct ff_socket_ops_zone *zone, uint16_t idx)
+{
+    return (zone->inuse[idx >> 6] >> (idx & 63)) & 1;
+}
+
+/* Ring the doorbell of sc, tell fstack instance it has something to do */
+static inline void
+ff_so_doorbell(struct ff_so_context *sc)
+{
+    __atomic_fetch_or(&sc->zone->pending[sc->idx >> 6],
+        1ULL << (sc->idx & 63), __ATOMIC_RELEASE);
+}
+
+static inline int
+ff_bound_addr_len(const struct sockaddr *addr)
+{
+    return addr->sa_family == AF_INET6 ? sizeof(struct sockaddr_in6) :
+        sizeof(struct sockaddr_in);
+}
+
+static inline int
+ff_bound_addr_cmp(const struct sockaddr *a, const struct sockaddr *b)
+{
+    if (a->sa_family != b->sa_family) {
+        return 1;
+    }
+
+    if (a->sa_family == AF_INET6) {
+        const struct sockaddr_in6 *a6 = (const struct sockaddr_in6 *)a;
+        const struct sockaddr_in6 *b6 = (const struct sockaddr_in6 *)b;
+        return a6->sin6_port != b6->sin6_port ||
+            memcmp(&a6->sin6_addr, &b6->sin6_addr, sizeof(a6->sin6_addr));
+    }
+
+    const struct sockaddr_in *a4 = (const struct sockaddr_in *)a;
+    const struct sockaddr_in *b4 = (const struct sockaddr_in *)b;
+    return a4->sin_port != b4->sin_port ||
+        a4->sin_addr.s_addr != b4->sin_addr.s_addr;
+}
+
+static inline uint32_t
+ff_bound_addr_hash(const struct sockaddr *addr)
+{
+    uint32_t h;
+
+    if (addr->sa_family == AF_INET6) {
+        const struct sockaddr_in6 *a6 = (const struct sockaddr_in6 *)addr;
+        const uint32_t *w = (const uint32_t *)&a6->sin6_addr;
+        h = w[0] ^ w[1] ^ w[2] ^ w[3] ^ a6->sin6_port;
+    } else {
+        const struct sockaddr_in *a4 = (const struct sockaddr_in *)addr;
+        h = a4->sin_addr.s_addr ^ ((uint32_t)a4->sin_port << 16);
+    }
+
+    return (h * 0x9e3779b1U) >> 16;
+}
+
+/* Slot of addr in the bound table of zone, or NULL */
+static inline struct ff_bound_info *
+ff_bound_lookup(struct ff_socket_ops_zone *zone, const struct sockaddr *addr)
+{
+    uint32_t i, slot = ff_bound_addr_hash(addr);
+    struct ff_bound_info *b;
+
+    for (i = 0; i < FF_MAX_BOUND_NUM; i++) {
+        b = &zone->bound[(slot + i) & FF_BOUND_MASK];
+        if (b->state == FF_BOUND_EMPTY) {
+            break;
+        }
+
+        if (b->state == FF_BOUND_USED &&
+            ff_bound_addr_cmp((struct sockaddr *)&b->addr, addr) == 0) {
+            return b;
+        }
+    }
+
+    return NULL;
+}
+
 extern __FF_THREAD struct ff_socket_ops_zone *ff_so_zone;
 #ifdef FF_MULTI_SC
-extern struct ff_socket_ops_zone *ff_so_zones[SOCKET_OPS_CONTEXT_MAX_NUM];
+extern struct ff_socket_ops_zone *ff_so_zones[SOCKET_OPS_ZONE_MAX_NUM];
 #endif
 
 /* For primary process */
@@ -123,6 +311,9 @@ int ff_create_so_memzone();
 void ff_handle_each_context();
 
 /* For secondary process */
+#ifdef FF_MULTI_SC
+struct ff_socket_ops_zone *ff_lookup_so_zone(int proc_id);
+#endif
 struct ff_so_context *ff_attach_so_context(int proc_id);
 void ff_detach_so_context(struct ff_so_context *context);
 
@@ -194,4 +194,31 @@ struct ff_fork_args {
 
 };
 
+/* Buffer in shared memory, owned by the fstack instance after sending */
+struct ff_zc_write_args {
+    int fd;
+    void *buf;
+    size_t len;
+    int flags;
+};
+
+/*
+ * The received mbuf chain is lent to APP through iov if all segments live
+ * in shared memory, and must be given back with FF_SO_ZC_FREE.
+ * Otherwise mbuf is NULL and the data is copied to buf.
+ */
+struct ff_zc_read_args {
+    int fd;
+    void *buf;
+    size_t len;
+    int flags;
+    void *mbuf;
+    struct iovec *iov;
+    int iovcnt;
+};
+
+struct ff_zc_free_args {
+    void *mbuf;
+};
+
 #endif
@@ -1,7 +1,10 @@
+#include <stdlib.h>
+
 #include "ff_api.h"
 #include "ff_socket_ops.h"
 
-#define WORKERS 32
+/* Number of so_context of each fstack instance, i.e. max APP threads attached */
+#define FF_SO_CONTEXT_NUM_STR "FF_SO_CONTEXT_NUM"
 
 int
 loop(void *arg)
@@ -15,10 +18,18 @@ int
 main(int argc, char * argv[])
 {
     int ret;
+    uint16_t workers = SOCKET_OPS_CONTEXT_DEFAULT_NUM;
+    char *so_context_num;
 
     ff_init(argc, argv);
 
-    ret = ff_set_max_so_context(WORKERS);
+    so_context_num = getenv(FF_SO_CONTEXT_NUM_STR);
+    if (so_context_num != NULL) {
+        workers = (uint16_t)strtoul(so_context_num, NULL, 10);
+        ERR_LOG("get FF_SO_CONTEXT_NUM=%s, use %d\n", so_context_num, workers);
+    }
+
+    ret = ff_set_max_so_context(workers);
     if (ret < 0) {
         return -1;
     }
@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <rte_eal.h>
+
+#include "ff_config.h"
+#include "ff_api.h"
+
+/*
+ * Reset and expiry throughput of the callwheel of lib/ff_kern_timeout.c
+ * with 1M, 5M and 10M armed callouts. Only the FreeBSD side is brought up,
+ * no port is touched, and the clock is advanced by hand. The hooks are only
+ * in a libfstack built with FF_CALLOUT_BENCH=1:
+ *
+ *   make -C ../lib FF_CALLOUT_BENCH=1 && make timer_bench
+ *   ./timer_bench --conf config.ini --proc-type=primary --proc-id=0
+ *
+ * Timeouts are spread over MAX_TIMEOUT ticks, so that every reset and the
+ * expiry runs go through the cascades of the first three wheel levels.
+ */
+
+#define MAX_TIMEOUT (1 << 16)
+
+extern int ff_freebsd_init(void);
+extern int ff_callout_bench_init(unsigned n);
+extern void ff_callout_bench_reset(unsigned i, int to_ticks);
+extern uint64_t ff_callout_bench_tick(void);
+extern void ff_callout_bench_fini(void);
+
+static const unsigned bench_sizes[] = { 1000000, 5000000, 10000000 };
+
+static uint64_t rand_state = 88172645463325252ULL;
+
+static inline uint32_t
+bench_rand(void)
+{
+    rand_state ^= rand_state << 13;
+    rand_state ^= rand_state >> 7;
+    rand_state ^= rand_state << 17;
+    return (uint32_t)rand_state;
+}
+
+static double
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+bench_run(unsigned n)
+{
+    double start, reset_time, expire_time;
+    uint64_t expired = 0;
+    unsigned i, ticks = 0;
+
+    if (ff_callout_bench_init(n) != 0) {
+        printf("%u timers: out of memory\n", n);
+        return -1;
+    }
+
+    for (i = 0; i < n; i++) {
+        ff_callout_bench_reset(i, 1 + bench_rand() % MAX_TIMEOUT);
+    }
+
+    /* As TCP does on every segment: push an armed timer further away */
+    start = now();
+    for (i = 0; i < n; i++) {
+        ff_callout_bench_reset(bench_rand() % n,
+            1 + bench_rand() % MAX_TIMEOUT);
+    }
+    reset_time = now() - start;
+
+    start = now();
+    while (expired < n) {
+        expired = ff_callout_bench_tick();
+        if (++ticks > MAX_TIMEOUT + 1) {
+            printf("%u timers: only %lu expired\n", n, (unsigned long)expired);
+            break;
+        }
+    }
+    expire_time = now() - start;
+
+    printf("%9u timers: %12.0f resets/s %12.0f expiries/s\n", n,
+        n / reset_time, expired / expire_time);
+
+    ff_callout_bench_fini();
+
+    return 0;
+}
+
+int main(int argc, char * argv[])
+{
+    unsigned i;
+
+    if (ff_load_config(argc, argv) < 0)
+        exit(1);
+
+    /* For the TSC frequency used by the FreeBSD timecounter */
+    if (rte_eal_init(dpdk_argc, (char **)&dpdk_argv) < 0)
+        exit(1);
+
+    if (ff_freebsd_init() < 0)
+        exit(1);
+
+    for (i = 0; i < sizeof(bench_sizes) / sizeof(bench_sizes[0]); i++) {
+        if (bench_run(bench_sizes[i]) < 0)
+            exit(1);
+    }
+
+    return 0;
+}
@@ -227,6 +227,125 @@ SYSCTL_INT(_net_inet_ip_portrange, OID_AUTO, randomtime,
 	"Minimum time to keep sequental port "
 	"allocation before switching to a random one");
 
+#ifdef FSTACK
+/*
+ * RSS partitioned ephemeral ports.
+ * The ports whose tuple lands on our queue are computed for each
+ * (laddr, faddr, fport) with ff_rss_lports() and handed out in turn,
+ * instead of probing random ports with ff_rss_check() until one matches.
+ * A set only covers a window of FF_LPORT_SET_PORTS ports from a random
+ * start, so that a cache miss stays cheap with many destinations. It is
+ * recomputed once the window is used up or the RSS RETA of the port has
+ * been rewritten.
+ */
+static int ff_rss_lport_sets = 0;
+SYSCTL_INT(_net_inet_ip_portrange, OID_AUTO, rss_sets, CTLFLAG_RW,
+	&ff_rss_lport_sets, 0,
+	"Precompute the ephemeral ports of the local RSS queue per destination");
+
+#define	FF_LPORT_SETS_SIZE	64
+#define	FF_LPORT_SET_PORTS	4096
+
+struct ff_lport_set {
+	void		*softc;
+	in_addr_t	laddr;
+	in_addr_t	faddr;
+	u_short		fport;
+	u_short		first;
+	u_short		last;
+	uint32_t	gen;
+	int		nb;
+	int		next;
+	u_short		*lports;
+};
+
+static struct ff_lport_set ff_lport_sets_cache[FF_LPORT_SETS_SIZE];
+
+static struct ff_lport_set *
+ff_lport_set_get(void *softc, struct in_addr laddr, struct in_addr faddr,
+    u_short fport)
+{
+	struct ff_lport_set *set;
+	u_short aux, first, last;
+	uint32_t h, gen;
+	int span, start, end;
+
+	first = V_ipport_firstauto;
+	last = V_ipport_lastauto;
+	if (first > last) {
+		aux = first;
+		first = last;
+		last = aux;
+	}
+
+	gen = ff_rss_generation(softc);
+	h = ntohl(faddr.s_addr) * 31 + ntohl(laddr.s_addr) + ntohs(fport);
+	set = &ff_lport_sets_cache[h % FF_LPORT_SETS_SIZE];
+	if (set->lports != NULL && set->softc == softc &&
+	    set->laddr == laddr.s_addr && set->faddr == faddr.s_addr &&
+	    set->fport == fport && set->first == first && set->last == last &&
+	    set->gen == gen)
+		return (set);
+
+	if (set->lports == NULL) {
+		set->lports = malloc(sizeof(u_short) * FF_LPORT_SET_PORTS,
+		    M_PCB, M_NOWAIT);
+		if (set->lports == NULL)
+			return (NULL);
+	}
+
+	set->softc = softc;
+	set->laddr = laddr.s_addr;
+	set->faddr = faddr.s_addr;
+	set->fport = fport;
+	set->first = first;
+	set->last = last;
+	set->gen = gen;
+
+	/* The window wraps around to first if it runs past last. */
+	span = last - first + 1;
+	start = first + arc4random() % span;
+	end = start + min(span, FF_LPORT_SET_PORTS) - 1;
+	set->nb = ff_rss_lports(softc, faddr.s_addr, laddr.s_addr, fport,
+	    start, min(end, last), set->lports, FF_LPORT_SET_PORTS);
+	if (end > last)
+		set->nb += ff_rss_lports(softc, faddr.s_addr, laddr.s_addr,
+		    fport, first, first + end - last - 1,
+		    set->lports + set->nb, FF_LPORT_SET_PORTS - set->nb);
+	set->next = 0;
+
+	return (set);
+}
+
+static int
+ff_lport_set_alloc(struct inpcb *inp, struct ff_lport_set *set,
+    struct in_addr laddr, u_short *lportp, struct ucred *cred)
+{
+	struct inpcbinfo *pcbinfo = inp->inp_pcbinfo;
+	int lookupflags = 0;
+	u_short lport;
+
+	if ((inp->inp_socket->so_options &
+	    (SO_REUSEADDR|SO_REUSEPORT|SO_REUSEPORT_LB)) == 0)
+		lookupflags = INPLOOKUP_WILDCARD;
+
+	while (set->next < set->nb) {
+		lport = set->lports[set->next++];
+
+		if (in_pcblookup_local(pcbinfo, laddr, lport, lookupflags,
+		    cred) == NULL) {
+			*lportp = lport;
+			inp->inp_flags |= INP_ANONPORT;
+			return (0);
+		}
+	}
+
+	/* Used up, take another window next time. */
+	set->softc = NULL;
+	return (EADDRNOTAVAIL);
+}
+#endif
+
 #ifdef RATELIMIT
 counter_u64_t rate_limit_active;
 counter_u64_t rate_limit_alloc_fail;
@@ -1506,6 +1625,17 @@ in_pcbconnect_setup(struct inpcb *inp, struct sockaddr *nam,
 				return (EADDRNOTAVAIL);
 		}
 		ifp = ifa->ifa_ifp;
+		if (ff_rss_lport_sets && (inp->inp_flags &
+		    (INP_HIGHPORT|INP_LOWPORT)) == 0) {
+			struct ff_lport_set *set;
+
+			set = ff_lport_set_get(ifp->if_softc, laddr, faddr,
+			    fport);
+			/* Probe below if the window is used up. */
+			if (set != NULL)
+				(void)ff_lport_set_alloc(inp, set, laddr,
+				    &lport, cred);
+		}
 		while (lport == 0) {
 			int rss;
 			error = in_pcbbind_setup(inp, NULL, &laddr.s_addr, &lport,
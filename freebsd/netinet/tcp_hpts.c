@@ -1869,6 +1869,42 @@ tcp_hpts_thread(void *ctx)
 
 #undef	timersub
 
+#ifdef FSTACK
+/*
+ * Run the pacers from the main loop, independently of the callout
+ * which only fires once per hz tick.  Returns the number of connections
+ * still waiting on the wheels so the caller doesn't go idle on them.
+ */
+int ff_hpts_run(void);
+
+int
+ff_hpts_run(void)
+{
+	struct tcp_hpts_entry *hpts;
+	struct epoch_tracker et;
+	int32_t i, pending = 0;
+
+	for (i = 0; i < tcp_pace.rp_num_hptss; i++) {
+		hpts = tcp_pace.rp_ent[i];
+		if (hpts->p_on_queue_cnt == 0 && hpts->p_on_inqueue_cnt == 0)
+			continue;
+
+		mtx_lock(&hpts->p_mtx);
+		if (hpts->p_hpts_active == 0) {
+			hpts->p_hpts_active = 1;
+			NET_EPOCH_ENTER(et);
+			tcp_hptsi(hpts);
+			NET_EPOCH_EXIT(et);
+			hpts->p_hpts_active = 0;
+		}
+		pending += hpts->p_on_queue_cnt + hpts->p_on_inqueue_cnt;
+		mtx_unlock(&hpts->p_mtx);
+	}
+
+	return (pending);
+}
+#endif
+
 static void
 tcp_init_hptsi(void *st)
 {
@@ -727,6 +727,25 @@ syncache_badack(struct in_conninfo *inc)
 	SCH_UNLOCK(sch);
 }
 
+#ifdef FSTACK
+/*
+ * Whether the connection has an entry in the syncache, for the ACK
+ * completing its handshake to be kept on this queue.
+ */
+int
+syncache_exists(struct in_conninfo *inc)
+{
+	struct syncache *sc;
+	struct syncache_head *sch;
+
+	if (syncache_cookiesonly())
+		return (0);
+	sc = syncache_lookup(inc, &sch);	/* returns locked sch */
+	SCH_UNLOCK(sch);
+	return (sc != NULL);
+}
+#endif
+
 void
 syncache_unreach(struct in_conninfo *inc, tcp_seq th_seq)
 {
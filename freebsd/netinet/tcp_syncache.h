@@ -48,6 +48,9 @@ int	 syncache_add(struct in_conninfo *, struct tcpopt *,
 	     void *, void *, uint8_t);
 void	 syncache_chkrst(struct in_conninfo *, struct tcphdr *, struct mbuf *);
 void	 syncache_badack(struct in_conninfo *);
+#ifdef FSTACK
+int	 syncache_exists(struct in_conninfo *);
+#endif
 int	 syncache_pcblist(struct sysctl_req *);
 
 struct syncache {
@@ -204,6 +204,34 @@ typedef int (*dispatch_func_t)(void *data, uint16_t *len,
 /* regist a packet dispath function */
 void ff_regist_packet_dispatcher(dispatch_func_t func);
 
+/*
+ * Burst packet dispatch callback function.
+ * Implemented by user, called once for every received burst.
+ *
+ * @param data
+ *   The data pointers of the packets.
+ * @param len
+ *   The lengths of the packets, may be updated as in dispatch_func_t.
+ * @param verdicts
+ *   Filled by the callback, for each packet one of the return values
+ *   of dispatch_func_t.
+ * @param count
+ *   Number of packets in the burst.
+ * @param queue_id
+ *   Current queue of the packets.
+ * @param nb_queues
+ *   Number of queues to be dispatched.
+ *
+ */
+typedef void (*dispatch_burst_func_t)(void **data, uint16_t *len,
+    int *verdicts, uint16_t count, uint16_t queue_id, uint16_t nb_queues);
+
+/*
+ * regist a burst packet dispatch function,
+ * takes precedence over ff_regist_packet_dispatcher.
+ */
+void ff_regist_packet_dispatcher_burst(dispatch_burst_func_t func);
+
 /* dispatch api end */
 
 /* pcb lddr api begin */
@@ -317,10 +345,118 @@ int ff_zc_mbuf_get(struct ff_zc_mbuf *m, int len);
 int ff_zc_mbuf_write(struct ff_zc_mbuf *m, const char *data, int len);
 
 /*
- * Read data to the mbuf chain in 'sturct ff_zc_mbuf'.
- * not implemented now.
+ * Receive data from socket without copy.
+ * Up to 'len' bytes are dequeued from the socket receive buffer and the mbuf
+ * chain is lent to APP through 'm', the data still lives in the rte_mbuf
+ * data areas it was received into.
+ *
+ * APP walks the data with 'ff_zc_mbuf_read' and must call 'ff_zc_mbuf_free'
+ * to give the chain back to the stack after use.
+ *
+ * @param fd
+ *   The socket to receive from.
+ * @param m
+ *   The ponitor of 'sturct ff_zc_mbuf', and can't be NULL.
+ * @param len
+ *   The max len that APP want to receive this time.
+ * @param flags
+ *   Same as 'ff_recv'.
+ *
+ * @return
+ *   The total len of the mbuf chain lent to APP, 0 means EOF.
+ *  -1 means error, and errno is set.
+ */
+ssize_t ff_zc_recv(int fd, struct ff_zc_mbuf *m, size_t len, int flags);
+
+/*
+ * Read the next segment of the mbuf chain in 'sturct ff_zc_mbuf'
+ * that filled by 'ff_zc_recv'.
+ * APP should call this function repeatedly until it return 0.
+ *
+ * @param m
+ *   The ponitor of 'sturct ff_zc_mbuf', must be filled by 'ff_zc_recv' first.
+ * @param data
+ *   Return the pointer of the segment data, valid until 'ff_zc_mbuf_free'.
+ *
+ * @return
+ *   The len of the segment, 0 means no more data.
+ *  -1 means error.
+ */
+int ff_zc_mbuf_read(struct ff_zc_mbuf *m, const char **data);
+
+/*
+ * Give the mbuf chain filled by 'ff_zc_recv' back to the stack.
+ */
+void ff_zc_mbuf_free(struct ff_zc_mbuf *m);
+
+/*
+ * Attach an APP buffer to 'sturct ff_zc_mbuf' by reference, without copy.
+ * APP sends it the same way as 'ff_zc_mbuf_write', call 'ff_write' with
+ * 'bsd_mbuf' of 'struct ff_zc_mbuf' as the 'buf' argument.
+ *
+ * The buffer must not be modified or freed until its 'cookie' is returned
+ * by 'ff_zc_completions', that is when the socket buffer released it,
+ * e.g. after all the data has been acked by the peer.
+ *
+ * @param m
+ *   The ponitor of 'sturct ff_zc_mbuf', and can't be NULL.
+ * @param buf
+ *   The APP buffer to send.
+ * @param len
+ *   The len of the buffer.
+ * @param cookie
+ *   The value returned by 'ff_zc_completions' when the buffer is released.
+ *
+ * @return error_no
+ *   0 means success.
+ *  -1 means error.
+ */
+int ff_zc_mbuf_attach(struct ff_zc_mbuf *m, void *buf, int len, uint64_t cookie);
+
+/*
+ * Send the mbuf chain in 'sturct ff_zc_mbuf' filled by 'ff_zc_mbuf_get'
+ * and 'ff_zc_mbuf_write', or by 'ff_zc_mbuf_attach', without copy.
+ * Unlike 'ff_write' with FF_ZC_SEND, the rest of the APP's 'ff_write'
+ * calls still copy as usual.
+ *
+ * Like 'ff_write', at most the free space of the socket send buffer is
+ * queued, and the rest of the chain is freed, as is the whole chain on
+ * error. 'm' can't be sent again before recall 'ff_zc_mbuf_get' or
+ * 'ff_zc_mbuf_attach'.
+ *
+ * @param fd
+ *   The socket to send to.
+ * @param m
+ *   The ponitor of 'sturct ff_zc_mbuf', and can't be NULL.
+ * @param flags
+ *   Same as 'ff_send'.
+ *
+ * @return
+ *   The len sent, may be less than the chain for a stream socket.
+ *  -1 means error, and errno is set.
+ */
+ssize_t ff_zc_send(int fd, struct ff_zc_mbuf *m, int flags);
+
+/*
+ * Register a EVFILT_USER event 'ident' on 'kq' that is triggered once per
+ * loop when there are new zero copy TX completions.
+ * 'kq' can also be the fd returned by 'ff_epoll_create', the completions
+ * are reported as EPOLLIN with 'ident' in 'data.fd'.
+ * A negative 'kq' disables the notification.
+ *
+ * @return error_no
+ *   0 means success.
+ *  -1 means error.
+ */
+int ff_zc_notify(int kq, uintptr_t ident);
+
+/*
+ * Get up to 'n' cookies of the released buffers attached by 'ff_zc_mbuf_attach'.
+ *
+ * @return
+ *   The number of cookies stored in 'cookies'.
  */
-int ff_zc_mbuf_read(struct ff_zc_mbuf *m, const char *data, int len);
+int ff_zc_completions(uint64_t *cookies, int n);
 
 /* ZERO COPY API end */
 
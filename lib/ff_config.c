@@ -30,6 +30,8 @@
 #include <stdint.h>
 #include <getopt.h>
 #include <ctype.h>
+#include <strings.h>
+#include <netinet/in.h>
 #include <rte_config.h>
 #include <rte_string_fns.h>
 
@@ -274,7 +276,7 @@ __parse_config_list(uint16_t *arr, int *sz, const char *value) {
                 fprintf(stderr, "%s is not a integer.", tok);
                 return 0;
             }
-            if (nr_ele > max_ele) {
+            if (nr_ele >= max_ele) {
                 fprintf(stderr, "too many elements in list %s\n", value);
                 return 0;
             }
@@ -294,7 +296,7 @@ __parse_config_list(uint16_t *arr, int *sz, const char *value) {
                 return 0;
             }
             for (j = lv; j <= rv; ++j) {
-                if (nr_ele > max_ele) {
+                if (nr_ele >= max_ele) {
                     fprintf(stderr, "too many elements in list %s.\n", value);
                     return 0;
                 }
@@ -319,6 +321,74 @@ parse_port_lcore_list(struct ff_port_cfg *cfg, const char *v_str)
     return __parse_config_list(cores, &cfg->nb_lcores, v_str);
 }
 
+static int
+parse_port_flow_tcp_ports(struct ff_port_cfg *cfg, const char *v_str)
+{
+    cfg->nb_flow_tcp_ports = FF_MAX_FLOW_PORTS;
+    return __parse_config_list(cfg->flow_tcp_ports, &cfg->nb_flow_tcp_ports,
+        v_str);
+}
+
+/*
+ * flow_rules=proto:[sport:]dport:queue,...
+ * e.g. tcp:8080:1,udp:53:0
+ */
+static int
+parse_port_flow_rules(struct ff_port_cfg *cfg, const char *v_str)
+{
+    int i, j, nb_tokens, nb_fields;
+    char input[4096];
+    char *tokens[FF_MAX_FLOW_RULES];
+    char *fields[4];
+    char *endptr;
+    long v[3];
+
+    strncpy(input, v_str, sizeof(input) - 1);
+    input[sizeof(input) - 1] = '\0';
+    nb_tokens = rte_strsplit(input, sizeof(input), tokens,
+        FF_MAX_FLOW_RULES, ',');
+
+    cfg->nb_flow_rules = 0;
+    for (i = 0; i < nb_tokens; i++) {
+        struct ff_flow_rule *rule = &cfg->flow_rules[cfg->nb_flow_rules];
+
+        nb_fields = rte_strsplit(tokens[i], strlen(tokens[i]) + 1, fields,
+            4, ':');
+        if (nb_fields != 3 && nb_fields != 4) {
+            fprintf(stderr, "invalid flow rule %s\n", tokens[i]);
+            return 0;
+        }
+
+        fields[0] = __strstrip(fields[0]);
+        if (strcasecmp(fields[0], "tcp") == 0) {
+            rule->proto = IPPROTO_TCP;
+        } else if (strcasecmp(fields[0], "udp") == 0) {
+            rule->proto = IPPROTO_UDP;
+        } else {
+            fprintf(stderr, "unsupported flow rule protocol %s\n", fields[0]);
+            return 0;
+        }
+
+        v[0] = 0;
+        for (j = 1; j < nb_fields; j++) {
+            char *f = __strstrip(fields[j]);
+            long n = strtol(f, &endptr, 10);
+            if (*f == '\0' || *endptr != '\0' || n < 0 || n > UINT16_MAX) {
+                fprintf(stderr, "%s is not a valid port or queue.\n", f);
+                return 0;
+            }
+            v[j - 1 + (4 - nb_fields)] = n;
+        }
+
+        rule->sport = (uint16_t)v[0];
+        rule->dport = (uint16_t)v[1];
+        rule->queue = (uint16_t)v[2];
+        cfg->nb_flow_rules++;
+    }
+
+    return 1;
+}
+
 static int
 parse_port_list(struct ff_config *cfg, const char *v_str)
 {
@@ -511,6 +581,14 @@ port_cfg_handler(struct ff_config *cfg, const char *section,
         }
     } else if (strcmp(name, "vip_ifname") == 0) {
         cur->vip_ifname = strdup(value);
+    } else if (strcmp(name, "lro") == 0) {
+        cur->lro = atoi(value);
+    } else if (strcmp(name, "flow_isolate") == 0) {
+        cur->flow_isolate = atoi(value);
+    } else if (strcmp(name, "flow_tcp_ports") == 0) {
+        return parse_port_flow_tcp_ports(cur, value);
+    } else if (strcmp(name, "flow_rules") == 0) {
+        return parse_port_flow_rules(cur, value);
     }
 
 #ifdef INET6
@@ -691,8 +769,14 @@ ini_parse_handler(void* user, const char* section, const char* name,
         pconfig->dpdk.vlan_strip = atoi(value);
     } else if (MATCH("dpdk", "idle_sleep")) {
         pconfig->dpdk.idle_sleep = atoi(value);
+    } else if (MATCH("dpdk", "idle_sleep_max")) {
+        pconfig->dpdk.idle_sleep_max = atoi(value);
+    } else if (MATCH("dpdk", "rx_intr")) {
+        pconfig->dpdk.rx_intr = atoi(value);
     } else if (MATCH("dpdk", "pkt_tx_delay")) {
         pconfig->dpdk.pkt_tx_delay = atoi(value);
+    } else if (MATCH("dpdk", "reta_rebalance_ms")) {
+        pconfig->dpdk.reta_rebalance_ms = atoi(value);
     } else if (MATCH("dpdk", "symmetric_rss")) {
         pconfig->dpdk.symmetric_rss = atoi(value);
     } else if (MATCH("kni", "enable")) {
@@ -708,6 +792,10 @@ ini_parse_handler(void* user, const char* section, const char* name,
     } else if (strcmp(section, "freebsd.boot") == 0) {
         if (strcmp(name, "hz") == 0) {
             pconfig->freebsd.hz = atoi(value);
+        } else if (strcmp(name, "hpts_us") == 0) {
+            pconfig->freebsd.hpts_us = atoi(value);
+        } else if (strcmp(name, "hugepage_mem") == 0) {
+            pconfig->freebsd.hugepage_mem = atoi(value);
         } else if (strcmp(name, "physmem") == 0) {
             pconfig->freebsd.physmem = atol(value);
         } else if (strcmp(name, "fd_reserve") == 0) {
@@ -46,6 +46,18 @@ extern char *dpdk_argv[DPDK_CONFIG_NUM + 1];
 
 #define VIP_MAX_NUM 64
 
+#define FF_MAX_FLOW_PORTS 16
+#define FF_MAX_FLOW_RULES 32
+
+/* Steer the packets of a protocol/port class to one rx queue */
+struct ff_flow_rule {
+    uint8_t proto;
+    /* 0 matches any port */
+    uint16_t sport;
+    uint16_t dport;
+    uint16_t queue;
+};
+
 struct ff_hw_features {
     uint8_t rx_csum;
     uint8_t rx_lro;
@@ -60,6 +72,7 @@ struct ff_port_cfg {
     uint8_t port_id;
     uint8_t mac[6];
     struct ff_hw_features hw_features;
+    uint8_t lro;
     char *addr;
     char *netmask;
     char *broadcast;
@@ -85,6 +98,13 @@ struct ff_port_cfg {
     int nb_slaves;
     uint16_t lcore_list[DPDK_MAX_LCORE];
     uint16_t *slave_portid_list;
+
+    /* rte_flow rules, installed by the primary process */
+    uint8_t flow_isolate;
+    int nb_flow_tcp_ports;
+    uint16_t flow_tcp_ports[FF_MAX_FLOW_PORTS];
+    int nb_flow_rules;
+    struct ff_flow_rule flow_rules[FF_MAX_FLOW_RULES];
 };
 
 struct ff_vdev_cfg {
@@ -155,9 +175,18 @@ struct ff_config {
         /* sleep x microseconds when no pkts incomming */
         unsigned idle_sleep;
 
+        /* max sleep of the adaptive idle backoff, 0 means fixed idle_sleep */
+        unsigned idle_sleep_max;
+
+        /* wait for RX interrupts once the idle backoff reaches its max */
+        int rx_intr;
+
         /* TX burst queue drain nodelay dalay time */
         unsigned pkt_tx_delay;
 
+        /* rebalance the RSS RETA every x milliseconds, 0 means static */
+        unsigned reta_rebalance_ms;
+
         /* list of proc-lcore */
         uint16_t *proc_lcore;
 
@@ -191,6 +220,8 @@ struct ff_config {
         struct ff_freebsd_cfg *sysctl;
         long physmem;
         int hz;
+        int hpts_us;
+        int hugepage_mem;
         int fd_reserve;
         int mem_size;
     } freebsd;
@@ -45,9 +45,11 @@
 #include <rte_debug.h>
 #include <rte_common.h>
 #include <rte_ether.h>
+#include <rte_arp.h>
 #include <rte_malloc.h>
 #include <rte_cycles.h>
 #include <rte_timer.h>
+#include <rte_interrupts.h>
 #include <rte_thash.h>
 #include <rte_ip.h>
 #include <rte_tcp.h>
@@ -77,6 +79,8 @@ static int knictl_action = FF_KNICTL_ACTION_DEFAULT;
 static int numa_on;
 
 static unsigned idle_sleep;
+static unsigned idle_sleep_max;
+static int rx_intr;
 static unsigned pkt_tx_delay;
 static uint64_t usr_cb_tsc;
 
@@ -119,16 +123,59 @@ struct lcore_conf lcore_conf;
 struct rte_mempool *pktmbuf_pool[NB_SOCKETS];
 struct rte_mempool *pktmbuf_ref_pool[NB_SOCKETS];
 
+/* Per-lcore stock of TX mbufs, refilled from the pools in bulk */
+#define TX_MBUF_CACHE_SIZE  MAX_PKT_BURST
+
+struct tx_mbuf_cache {
+    uint16_t len;
+    struct rte_mbuf *m[TX_MBUF_CACHE_SIZE];
+};
+
+static struct tx_mbuf_cache tx_head_cache;
+static struct tx_mbuf_cache tx_ref_cache;
+
+/* Ports with TSO frames staged since the last tx_tso_flush() */
+static uint8_t tx_tso_staged[RTE_MAX_ETHPORTS];
+static int tx_tso_pending;
+
 static pcblddr_func_t pcblddr_fun;
 
 static struct rte_ring **dispatch_ring[RTE_MAX_ETHPORTS];
 static dispatch_func_t packet_dispatcher;
+static dispatch_burst_func_t packet_dispatcher_burst;
 
 static uint16_t rss_reta_size[RTE_MAX_ETHPORTS];
 
+/*
+ * RSS RETA of the ports, shared by all processes in the FF_RETA_MZ memzone
+ * when dpdk.reta_rebalance_ms is set. The primary moves buckets from the
+ * busiest queue of a port to the idlest one, a moved bucket remembers its
+ * previous queue and the new queue hands the packets of connections it
+ * doesn't own back through the dispatch ring, until the previous queue has
+ * no TCP connection left in the bucket and has not seen any packet handed
+ * back for FF_RETA_HANDOFF_QUIET rounds.
+ */
+#define FF_RETA_MZ              "ff_reta"
+#define FF_RETA_NO_HANDOFF      UINT16_MAX
+/* Minimum difference of busy ratio in percent to move buckets */
+#define FF_RETA_MIN_IMBALANCE   20
+#define FF_RETA_HANDOFF_QUIET   8
+#define FF_RETA_MAX_MOVES       16
+
+struct ff_reta {
+    uint32_t generation;
+    uint8_t enabled;
+    uint16_t queue[FF_RETA_SIZE_MAX];
+    uint16_t prev[FF_RETA_SIZE_MAX];
+} __rte_cache_aligned;
+
+static struct ff_reta *reta_tables;
+static unsigned reta_rebalance_ms;
+
 #define BOND_DRIVER_NAME    "net_bonding"
 
 static inline int send_single_packet(struct rte_mbuf *m, uint8_t port);
+static int port_flow_isolate(uint16_t port_id, int set);
 
 struct ff_msg_ring {
     char ring_name[FF_MSG_NUM][RTE_RING_NAMESIZE];
@@ -141,9 +188,11 @@ static struct ff_msg_ring msg_ring[RTE_MAX_LCORE];
 static struct rte_mempool *message_pool;
 static struct ff_dpdk_if_context *veth_ctx[RTE_MAX_ETHPORTS];
 
-static struct ff_top_args ff_top_status;
-static struct ff_traffic_args ff_traffic;
+static struct ff_stats *ff_stats;
 extern void ff_hardclock(void);
+#ifdef FF_TCPHPTS
+extern int ff_hpts_run(void);
+#endif
 
 static void
 ff_hardclock_job(__rte_unused struct rte_timer *timer,
@@ -398,7 +447,8 @@ init_mem_pool(void *buffers, unsigned count, unsigned size)
         nb_mbuf = RTE_ALIGN_CEIL (
             nb_ports*nb_lcores*MAX_PKT_BURST    +
             nb_ports*nb_tx_queue*TX_QUEUE_SIZE  +
-            nb_lcores*MEMPOOL_CACHE_SIZE,
+            nb_lcores*MEMPOOL_CACHE_SIZE        +
+            nb_lcores*TX_MBUF_CACHE_SIZE,
             (unsigned)4096);
         ff_init_ref_pool(nb_mbuf, socketid);
 
@@ -537,6 +587,86 @@ init_msg_ring(void)
     return 0;
 }
 
+static int
+init_stats(void)
+{
+    char name[RTE_MEMZONE_NAMESIZE];
+    const struct rte_memzone *mz;
+    uint16_t i, port_id;
+
+    snprintf(name, sizeof(name), "%s%u", FF_STATS_MZ, lcore_conf.proc_id);
+
+    /* Reuse the memzone if this process has been restarted */
+    mz = rte_memzone_lookup(name);
+    if (mz == NULL) {
+        mz = rte_memzone_reserve(name, sizeof(struct ff_stats),
+            lcore_conf.socket_id, 0);
+        if (mz == NULL) {
+            rte_exit(EXIT_FAILURE, "Cannot reserve stats memzone %s: %s\n",
+                name, rte_strerror(rte_errno));
+        }
+    }
+
+    ff_stats = mz->addr;
+    memset(ff_stats, 0, sizeof(struct ff_stats));
+
+    for (i = 0; i < lcore_conf.nb_tx_port; i++) {
+        port_id = lcore_conf.tx_port_id[i];
+        ff_stats->port[port_id].queue_id = lcore_conf.tx_queue_id[port_id];
+        ff_stats->port[port_id].enabled = 1;
+    }
+
+    return 0;
+}
+
+/* Called once the ports are started and rss_reta_size is known */
+static int
+init_reta(void)
+{
+    const struct rte_memzone *mz;
+    uint16_t i, b;
+
+    if (rte_eal_process_type() != RTE_PROC_PRIMARY) {
+        mz = rte_memzone_lookup(FF_RETA_MZ);
+        if (mz == NULL) {
+            rte_exit(EXIT_FAILURE, "Cannot find memzone %s\n", FF_RETA_MZ);
+        }
+        reta_tables = mz->addr;
+        return 0;
+    }
+
+    mz = rte_memzone_reserve(FF_RETA_MZ,
+        sizeof(struct ff_reta) * RTE_MAX_ETHPORTS, lcore_conf.socket_id, 0);
+    if (mz == NULL) {
+        rte_exit(EXIT_FAILURE, "Cannot reserve memzone %s: %s\n",
+            FF_RETA_MZ, rte_strerror(rte_errno));
+    }
+    reta_tables = mz->addr;
+    memset(reta_tables, 0, sizeof(struct ff_reta) * RTE_MAX_ETHPORTS);
+
+    for (i = 0; i < ff_global_cfg.dpdk.nb_ports; i++) {
+        uint16_t port_id = ff_global_cfg.dpdk.portid_list[i];
+        struct ff_port_cfg *pconf = &ff_global_cfg.dpdk.port_cfgs[port_id];
+        struct ff_reta *reta = &reta_tables[port_id];
+        uint16_t reta_size = rss_reta_size[port_id];
+
+        if (pconf->nb_lcores <= 1 || pconf->nb_slaves > 0 ||
+            pconf->flow_isolate || reta_size == 0 ||
+            reta_size > FF_RETA_SIZE_MAX) {
+            continue;
+        }
+
+        /* Same as set_rss_table */
+        for (b = 0; b < reta_size; b++) {
+            reta->queue[b] = b % pconf->nb_lcores;
+            reta->prev[b] = FF_RETA_NO_HANDOFF;
+        }
+        reta->enabled = 1;
+    }
+
+    return 0;
+}
+
 #ifdef FF_KNI
 
 static enum FF_KNICTL_CMD get_kni_action(const char *c){
@@ -580,8 +710,6 @@ init_kni(void)
 }
 #endif
 
-//RSS reta update will failed when enable flow isolate
-#ifndef FF_FLOW_ISOLATE
 static void
 set_rss_table(uint16_t port_id, uint16_t reta_size, uint16_t nb_queues)
 {
@@ -606,7 +734,66 @@ set_rss_table(uint16_t port_id, uint16_t reta_size, uint16_t nb_queues)
             port_id);
     }
 }
-#endif
+
+/*
+ * Table driven Toeplitz hash of the 12 bytes IPv4 tuple, or the 36 bytes
+ * IPv6 one, the hash is linear so it's the XOR of the contributions of each
+ * input byte, which are precomputed from rsskey.
+ */
+#define RSS_TUPLE_LEN   12
+#define RSS_TUPLE6_LEN  36
+
+static uint32_t rss_hash_table[RSS_TUPLE6_LEN][256];
+
+static inline uint32_t
+rss_key_word(unsigned bit)
+{
+    uint64_t w = 0;
+    unsigned i, off = bit >> 3;
+
+    for (i = 0; i < 5; i++) {
+        w <<= 8;
+        if (off + i < (unsigned)rsskey_len)
+            w |= rsskey[off + i];
+    }
+
+    return (uint32_t)(w >> (8 - (bit & 7)));
+}
+
+static void
+init_rss_hash_table(void)
+{
+    uint32_t key_words[8];
+    unsigned i, b, v;
+
+    for (i = 0; i < RSS_TUPLE6_LEN; i++) {
+        for (b = 0; b < 8; b++) {
+            key_words[b] = rss_key_word(i * 8 + b);
+        }
+
+        for (v = 0; v < 256; v++) {
+            uint32_t hash = 0;
+            for (b = 0; b < 8; b++) {
+                if (v & (0x80 >> b))
+                    hash ^= key_words[b];
+            }
+            rss_hash_table[i][v] = hash;
+        }
+    }
+}
+
+static inline uint32_t
+toeplitz_hash(const uint8_t *data, unsigned datalen, unsigned off)
+{
+    uint32_t hash = 0;
+    unsigned i;
+
+    for (i = 0; i < datalen; i++) {
+        hash ^= rss_hash_table[off + i][data[i]];
+    }
+
+    return (hash);
+}
 
 static int
 init_port_start(void)
@@ -706,6 +893,12 @@ init_port_start(void)
             /* Enable HW CRC stripping */
             port_conf.rxmode.offloads &= ~DEV_RX_OFFLOAD_KEEP_CRC;
 
+            /* RETA rebalancing counts the packets by RSS hash */
+            if (ff_global_cfg.dpdk.reta_rebalance_ms &&
+                (dev_info.rx_offload_capa & DEV_RX_OFFLOAD_RSS_HASH)) {
+                port_conf.rxmode.offloads |= DEV_RX_OFFLOAD_RSS_HASH;
+            }
+
             /* FIXME: Enable TCP LRO ?*/
             #if 0
             if (dev_info.rx_offload_capa & DEV_RX_OFFLOAD_TCP_LRO) {
@@ -767,7 +960,23 @@ init_port_start(void)
                 continue;
             }
 
+            if (rx_intr) {
+                port_conf.intr_conf.rxq = 1;
+            }
+
+            if (pconf->flow_isolate && port_flow_isolate(port_id, 1) < 0) {
+                rte_exit(EXIT_FAILURE, "port[%d], failed to isolate\n",
+                    port_id);
+            }
+
             ret = rte_eth_dev_configure(port_id, nb_queues, nb_queues, &port_conf);
+            if (ret != 0 && port_conf.intr_conf.rxq) {
+                printf("port[%d]: RX interrupts not supported, disable rx_intr\n",
+                    port_id);
+                rx_intr = 0;
+                port_conf.intr_conf.rxq = 0;
+                ret = rte_eth_dev_configure(port_id, nb_queues, nb_queues, &port_conf);
+            }
             if (ret != 0) {
                 return ret;
             }
@@ -838,15 +1047,10 @@ init_port_start(void)
             if (ret < 0) {
                 return ret;
             }
-    //RSS reta update will failed when enable flow isolate
-    #ifndef FF_FLOW_ISOLATE
-            if (nb_queues > 1) {
-                /*
-                 * FIXME: modify RSS set to FDIR
-                 */
+            /* RSS reta update will fail when flow isolate is enabled */
+            if (nb_queues > 1 && !pconf->flow_isolate) {
                 set_rss_table(port_id, dev_info.reta_size, nb_queues);
             }
-    #endif
 
             /* Enable RX in promiscuous mode for the Ethernet device. */
             if (ff_global_cfg.dpdk.promiscuous) {
@@ -860,6 +1064,8 @@ init_port_start(void)
         }
     }
 
+    init_rss_hash_table();
+
     if (rte_eal_process_type() == RTE_PROC_PRIMARY) {
         check_all_ports_link_status();
     }
@@ -884,7 +1090,6 @@ init_clock(void)
     return 0;
 }
 
-#if defined(FF_FLOW_ISOLATE) || defined(FF_FDIR)
 /** Print a message out of a flow error. */
 static int
 port_flow_complain(struct rte_flow_error *error)
@@ -925,10 +1130,7 @@ port_flow_complain(struct rte_flow_error *error)
            rte_strerror(err));
     return -err;
 }
-#endif
-
 
-#ifdef FF_FLOW_ISOLATE
 static int
 port_flow_isolate(uint16_t port_id, int set)
 {
@@ -1038,23 +1240,9 @@ create_tcp_flow(uint16_t port_id, uint16_t tcp_port) {
   return 1;
 }
 
+/* Send ARP to queue 0, needed once the port is isolated */
 static int
-init_flow(uint16_t port_id, uint16_t tcp_port) {
-  // struct ff_flow_cfg fcfg = ff_global_cfg.dpdk.flow_cfgs[0];
-
-  // int i;
-  // for (i = 0; i < fcfg.nb_port; i++) {
-  //     if(!create_tcp_flow(fcfg.port_id, fcfg.tcp_ports[i])) {
-  //         return 0;
-  //     }
-  // }
-
-  if(!create_tcp_flow(port_id, tcp_port)) {
-      rte_exit(EXIT_FAILURE, "create tcp flow failed\n");
-      return -1;
-  }
-
-  /*  ARP rule */
+create_arp_flow(uint16_t port_id) {
   struct rte_flow_attr attr = {.ingress = 1};
   struct rte_flow_action_queue queue = {.index = 0};
 
@@ -1092,31 +1280,23 @@ init_flow(uint16_t port_id, uint16_t tcp_port) {
   return 1;
 }
 
-#endif
-
-#ifdef FF_FDIR
 /*
  * Flow director allows the traffic to specific port to be processed on the
- * specific queue. Unlike FF_FLOW_ISOLATE, the FF_FDIR implementation uses
- * general flow rule so that most FDIR supported NIC will support. The best
- * using case of FDIR is (but not limited to), using multiple processes to
- * listen on different ports.
- *
- * This function can be called either in FSTACK or in end-application.
+ * specific queue. Unlike flow_isolate, it uses general flow rules so that
+ * most FDIR supported NIC will support. The best using case of FDIR is (but
+ * not limited to), using multiple processes to listen on different ports.
  *
  * Example:
  *  Given 2 fstack instances A and B. Instance A listens on port 80, and
  *  instance B listens on port 81. We want to process the traffic to port 80
  *  on rx queue 0, and the traffic to port 81 on rx queue 1.
- *  // port 80 rx queue 0
- *  ret = fdir_add_tcp_flow(port_id, 0, FF_FLOW_INGRESS, 0, 80);
- *  // port 81 rx queue 1
- *  ret = fdir_add_tcp_flow(port_id, 1, FF_FLOW_INGRESS, 0, 81);
+ *  [port0]
+ *  flow_rules=tcp:80:0,tcp:81:1
  */
 #define FF_FLOW_EGRESS		1
 #define FF_FLOW_INGRESS		2
 /**
- * Create a flow rule that moves packets with matching src and dest tcp port
+ * Create a flow rule that moves packets with matching src and dest port
  * to the target queue.
  *
  * This function uses general flow rules and doesn't rely on the flow_isolation
@@ -1129,25 +1309,28 @@ init_flow(uint16_t port_id, uint16_t tcp_port) {
  * @param dir
  *   The direction of the traffic.
  *   1 for egress, 2 for ingress and sum(1+2) for both.
- * @param tcp_sport
- *   The src tcp port to match.
- * @param tcp_dport
- *   The dest tcp port to match.
+ * @param proto
+ *   IPPROTO_TCP or IPPROTO_UDP.
+ * @param sport
+ *   The src port to match, 0 for any.
+ * @param dport
+ *   The dest port to match, 0 for any.
  *
+ * @return
+ *   The created flow, NULL on failure.
  */
-static int
-fdir_add_tcp_flow(uint16_t port_id, uint16_t queue, uint16_t dir,
-		uint16_t tcp_sport, uint16_t tcp_dport)
+static struct rte_flow *
+fdir_add_flow(uint16_t port_id, uint16_t queue, uint16_t dir,
+    uint8_t proto, uint16_t sport, uint16_t dport)
 {
     struct rte_flow_attr attr;
     struct rte_flow_item flow_pattern[4];
     struct rte_flow_action flow_action[2];
     struct rte_flow *flow = NULL;
     struct rte_flow_action_queue flow_action_queue = { .index = queue };
-    struct rte_flow_item_tcp tcp_spec;
-    struct rte_flow_item_tcp tcp_mask;
+    struct rte_flow_item_tcp tcp_spec, tcp_mask;
+    struct rte_flow_item_udp udp_spec, udp_mask;
     struct rte_flow_error rfe;
-    int res;
 
     memset(flow_pattern, 0, sizeof(flow_pattern));
     memset(flow_action, 0, sizeof(flow_action));
@@ -1171,32 +1354,183 @@ fdir_add_tcp_flow(uint16_t port_id, uint16_t queue, uint16_t dir,
     flow_pattern[1].type = RTE_FLOW_ITEM_TYPE_IPV4;
 
     /*
-     * set the third level of the pattern (TCP).
+     * set the third level of the pattern (TCP or UDP).
      */
-    memset(&tcp_spec, 0, sizeof(struct rte_flow_item_tcp));
-    memset(&tcp_mask, 0, sizeof(struct rte_flow_item_tcp));
-    tcp_spec.hdr.src_port = htons(tcp_sport);
-    tcp_mask.hdr.src_port = (tcp_sport == 0 ? 0: 0xffff);
-    tcp_spec.hdr.dst_port = htons(tcp_dport);
-    tcp_mask.hdr.dst_port = (tcp_dport == 0 ? 0: 0xffff);
-    flow_pattern[2].type = RTE_FLOW_ITEM_TYPE_TCP;
-    flow_pattern[2].spec = &tcp_spec;
-    flow_pattern[2].mask = &tcp_mask;
+    if (proto == IPPROTO_TCP) {
+        memset(&tcp_spec, 0, sizeof(struct rte_flow_item_tcp));
+        memset(&tcp_mask, 0, sizeof(struct rte_flow_item_tcp));
+        tcp_spec.hdr.src_port = htons(sport);
+        tcp_mask.hdr.src_port = (sport == 0 ? 0: 0xffff);
+        tcp_spec.hdr.dst_port = htons(dport);
+        tcp_mask.hdr.dst_port = (dport == 0 ? 0: 0xffff);
+        flow_pattern[2].type = RTE_FLOW_ITEM_TYPE_TCP;
+        flow_pattern[2].spec = &tcp_spec;
+        flow_pattern[2].mask = &tcp_mask;
+    } else {
+        memset(&udp_spec, 0, sizeof(struct rte_flow_item_udp));
+        memset(&udp_mask, 0, sizeof(struct rte_flow_item_udp));
+        udp_spec.hdr.src_port = htons(sport);
+        udp_mask.hdr.src_port = (sport == 0 ? 0: 0xffff);
+        udp_spec.hdr.dst_port = htons(dport);
+        udp_mask.hdr.dst_port = (dport == 0 ? 0: 0xffff);
+        flow_pattern[2].type = RTE_FLOW_ITEM_TYPE_UDP;
+        flow_pattern[2].spec = &udp_spec;
+        flow_pattern[2].mask = &udp_mask;
+    }
 
     flow_pattern[3].type = RTE_FLOW_ITEM_TYPE_END;
 
-    res = rte_flow_validate(port_id, &attr, flow_pattern, flow_action, &rfe);
-    if (res)
-	return (1);
+    if (rte_flow_validate(port_id, &attr, flow_pattern, flow_action, &rfe)) {
+        port_flow_complain(&rfe);
+        return NULL;
+    }
 
     flow = rte_flow_create(port_id, &attr, flow_pattern, flow_action, &rfe);
     if (!flow)
-	return port_flow_complain(&rfe);
+        port_flow_complain(&rfe);
 
-    return (0);
+    return flow;
 }
 
-#endif
+/*
+ * Queue rules of all ports, loaded from config.ini and changed by FF_FLOW
+ * msgs. Only the primary process owns the flow rules of the devices.
+ */
+#define FF_MAX_FLOW_ENTRIES 256
+
+struct ff_flow_entry {
+    struct rte_flow *flow;
+    uint16_t port_id;
+    uint8_t proto;
+    uint16_t sport;
+    uint16_t dport;
+    uint16_t queue;
+};
+
+static struct ff_flow_entry flow_entries[FF_MAX_FLOW_ENTRIES];
+
+static struct ff_flow_entry *
+flow_entry_lookup(uint16_t port_id, uint8_t proto, uint16_t sport,
+    uint16_t dport)
+{
+    int i;
+
+    for (i = 0; i < FF_MAX_FLOW_ENTRIES; i++) {
+        struct ff_flow_entry *e = &flow_entries[i];
+        if (e->flow != NULL && e->port_id == port_id && e->proto == proto &&
+            e->sport == sport && e->dport == dport) {
+            return e;
+        }
+    }
+
+    return NULL;
+}
+
+static int
+ff_flow_rule_add(uint16_t port_id, uint8_t proto, uint16_t sport,
+    uint16_t dport, uint16_t queue)
+{
+    struct ff_flow_entry *e = NULL;
+    struct rte_flow *flow;
+    int i;
+
+    if (port_id > ff_global_cfg.dpdk.max_portid ||
+        ff_global_cfg.dpdk.port_cfgs[port_id].name == NULL) {
+        return ENODEV;
+    }
+
+    if ((proto != IPPROTO_TCP && proto != IPPROTO_UDP) ||
+        queue >= ff_global_cfg.dpdk.port_cfgs[port_id].nb_lcores) {
+        return EINVAL;
+    }
+
+    if (flow_entry_lookup(port_id, proto, sport, dport) != NULL) {
+        return EEXIST;
+    }
+
+    for (i = 0; i < FF_MAX_FLOW_ENTRIES; i++) {
+        if (flow_entries[i].flow == NULL) {
+            e = &flow_entries[i];
+            break;
+        }
+    }
+    if (e == NULL) {
+        return ENOSPC;
+    }
+
+    flow = fdir_add_flow(port_id, queue, FF_FLOW_INGRESS, proto, sport, dport);
+    if (flow == NULL) {
+        return EIO;
+    }
+
+    e->flow = flow;
+    e->port_id = port_id;
+    e->proto = proto;
+    e->sport = sport;
+    e->dport = dport;
+    e->queue = queue;
+
+    printf("port[%d]: %s sport %u dport %u to queue %u\n", port_id,
+        proto == IPPROTO_TCP ? "tcp" : "udp", sport, dport, queue);
+
+    return 0;
+}
+
+static int
+ff_flow_rule_del(uint16_t port_id, uint8_t proto, uint16_t sport,
+    uint16_t dport)
+{
+    struct rte_flow_error error;
+    struct ff_flow_entry *e;
+
+    e = flow_entry_lookup(port_id, proto, sport, dport);
+    if (e == NULL) {
+        return ENOENT;
+    }
+
+    if (rte_flow_destroy(port_id, e->flow, &error)) {
+        port_flow_complain(&error);
+        return EIO;
+    }
+
+    memset(e, 0, sizeof(*e));
+
+    return 0;
+}
+
+static void
+init_flow(void)
+{
+    int i, j, ret;
+
+    for (i = 0; i < ff_global_cfg.dpdk.nb_ports; i++) {
+        uint16_t port_id = ff_global_cfg.dpdk.portid_list[i];
+        struct ff_port_cfg *pconf = &ff_global_cfg.dpdk.port_cfgs[port_id];
+
+        for (j = 0; j < pconf->nb_flow_tcp_ports; j++) {
+            if (create_tcp_flow(port_id, pconf->flow_tcp_ports[j]) < 0) {
+                rte_exit(EXIT_FAILURE, "port[%d], create tcp flow failed\n",
+                    port_id);
+            }
+        }
+
+        if (pconf->flow_isolate && create_arp_flow(port_id) < 0) {
+            rte_exit(EXIT_FAILURE, "port[%d], create arp flow failed\n",
+                port_id);
+        }
+
+        for (j = 0; j < pconf->nb_flow_rules; j++) {
+            struct ff_flow_rule *rule = &pconf->flow_rules[j];
+
+            ret = ff_flow_rule_add(port_id, rule->proto, rule->sport,
+                rule->dport, rule->queue);
+            if (ret) {
+                rte_exit(EXIT_FAILURE, "port[%d], add flow rule failed: %s\n",
+                    port_id, strerror(ret));
+            }
+        }
+    }
+}
 
 int
 ff_dpdk_init(int argc, char **argv, void *buffers, unsigned count,
@@ -1220,6 +1554,8 @@ ff_dpdk_init(int argc, char **argv, void *buffers, unsigned count,
     numa_on = ff_global_cfg.dpdk.numa_on;
 
     idle_sleep = ff_global_cfg.dpdk.idle_sleep;
+    idle_sleep_max = ff_global_cfg.dpdk.idle_sleep_max;
+    rx_intr = ff_global_cfg.dpdk.rx_intr;
     pkt_tx_delay = ff_global_cfg.dpdk.pkt_tx_delay > BURST_TX_DRAIN_US ? \
         BURST_TX_DRAIN_US : ff_global_cfg.dpdk.pkt_tx_delay;
 
@@ -1231,6 +1567,8 @@ ff_dpdk_init(int argc, char **argv, void *buffers, unsigned count,
 
     init_msg_ring();
 
+    init_stats();
+
 #ifdef FF_KNI
     enable_kni = ff_global_cfg.kni.enable;
     if (enable_kni) {
@@ -1242,85 +1580,106 @@ ff_dpdk_init(int argc, char **argv, void *buffers, unsigned count,
     ff_mmap_init();
 #endif
 
-#ifdef FF_FLOW_ISOLATE
-    // run once in primary process
-    if (0 == lcore_conf.tx_queue_id[0]){
-        ret = port_flow_isolate(0, 1);
-        if (ret < 0)
-            rte_exit(EXIT_FAILURE, "init_port_isolate failed\n");
-    }
-#endif
-
     ret = init_port_start();
     if (ret < 0) {
         rte_exit(EXIT_FAILURE, "init_port_start failed\n");
     }
 
     init_clock();
-#ifdef FF_FLOW_ISOLATE
-    //Only give a example usage: port_id=0, tcp_port= 80.
-    //Recommend:
-    //1. init_flow should replace `set_rss_table` in `init_port_start` loop, This can set all NIC's port_id_list instead only 0 device(port_id).
-    //2. using config options `tcp_port` replace magic number of 80
-    ret = init_flow(0, 80);
-    if (ret < 0) {
-        rte_exit(EXIT_FAILURE, "init_port_flow failed\n");
+
+    if (rte_eal_process_type() == RTE_PROC_PRIMARY) {
+        init_flow();
     }
-#endif
 
-#ifdef FF_FDIR
-    /*
-     * Refer function header section for usage.
-     */
-    ret = fdir_add_tcp_flow(0, 0, FF_FLOW_INGRESS, 0, 80);
-    if (ret)
-	rte_exit(EXIT_FAILURE, "fdir_add_tcp_flow failed\n");
-#endif
+    reta_rebalance_ms = ff_global_cfg.dpdk.reta_rebalance_ms;
+    if (reta_rebalance_ms) {
+        init_reta();
+    }
 
     return 0;
 }
 
+/*
+ * Wrap a burst of received packets into FreeBSD mbufs with a single call
+ * and feed them to the stack.
+ */
 static void
-ff_veth_input(const struct ff_dpdk_if_context *ctx, struct rte_mbuf *pkt)
+ff_veth_input_burst(const struct ff_dpdk_if_context *ctx,
+    struct rte_mbuf **pkts, uint16_t count)
 {
     uint8_t rx_csum = ctx->hw_features.rx_csum;
-    if (rx_csum) {
-        if (pkt->ol_flags & (RTE_MBUF_F_RX_IP_CKSUM_BAD | RTE_MBUF_F_RX_L4_CKSUM_BAD)) {
-            rte_pktmbuf_free(pkt);
-            return;
+    struct rte_mbuf *rx_pkts[MAX_PKT_BURST];
+    void *data[MAX_PKT_BURST];
+    void *hdrs[MAX_PKT_BURST];
+    uint16_t len[MAX_PKT_BURST];
+    uint16_t total[MAX_PKT_BURST];
+    uint16_t i, nb_rx = 0, nb_hdrs = 0;
+
+    for (i = 0; i < count; i++) {
+        struct rte_mbuf *pkt = pkts[i];
+
+        if (rx_csum) {
+            if (pkt->ol_flags & (RTE_MBUF_F_RX_IP_CKSUM_BAD | RTE_MBUF_F_RX_L4_CKSUM_BAD)) {
+                ff_stats->port[ctx->port_id].rx_dropped++;
+                rte_pktmbuf_free(pkt);
+                continue;
+            }
         }
-    }
 
-    void *data = rte_pktmbuf_mtod(pkt, void*);
-    uint16_t len = rte_pktmbuf_data_len(pkt);
+        rx_pkts[nb_rx] = pkt;
+        data[nb_rx] = rte_pktmbuf_mtod(pkt, void*);
+        len[nb_rx] = rte_pktmbuf_data_len(pkt);
+        total[nb_rx] = pkt->pkt_len;
+        nb_rx++;
+    }
 
-    void *hdr = ff_mbuf_gethdr(pkt, pkt->pkt_len, data, len, rx_csum);
-    if (hdr == NULL) {
-        rte_pktmbuf_free(pkt);
+    if (nb_rx == 0)
         return;
-    }
 
-    if (pkt->ol_flags & RTE_MBUF_F_RX_VLAN_STRIPPED) {
-        ff_mbuf_set_vlan_info(hdr, pkt->vlan_tci);
-    }
+    ff_mbuf_gethdr_burst((void **)rx_pkts, data, len, total, nb_rx,
+        rx_csum, hdrs);
 
-    struct rte_mbuf *pn = pkt->next;
-    void *prev = hdr;
-    while(pn != NULL) {
-        data = rte_pktmbuf_mtod(pn, void*);
-        len = rte_pktmbuf_data_len(pn);
+    for (i = 0; i < nb_rx; i++) {
+        struct rte_mbuf *pkt = rx_pkts[i];
+        void *hdr = hdrs[i];
 
-        void *mb = ff_mbuf_get(prev, pn, data, len);
-        if (mb == NULL) {
-            ff_mbuf_free(hdr);
+        if (hdr == NULL) {
+            ff_stats->port[ctx->port_id].rx_dropped++;
             rte_pktmbuf_free(pkt);
-            return;
+            continue;
         }
-        pn = pn->next;
-        prev = mb;
+
+        if (pkt->ol_flags & RTE_MBUF_F_RX_VLAN_STRIPPED) {
+            ff_mbuf_set_vlan_info(hdr, pkt->vlan_tci);
+        }
+
+        struct rte_mbuf *pn = pkt->next;
+        void *prev = hdr;
+        while(pn != NULL) {
+            void *seg_data = rte_pktmbuf_mtod(pn, void*);
+            uint16_t seg_len = rte_pktmbuf_data_len(pn);
+
+            void *mb = ff_mbuf_get(prev, pn, seg_data, seg_len);
+            if (mb == NULL) {
+                /*
+                 * Segments already attached are released with hdr,
+                 * free the remaining ones.
+                 */
+                ff_mbuf_free(hdr);
+                rte_pktmbuf_free(pn);
+                ff_stats->port[ctx->port_id].rx_dropped++;
+                hdr = NULL;
+                break;
+            }
+            pn = pn->next;
+            prev = mb;
+        }
+
+        if (hdr != NULL)
+            hdrs[nb_hdrs++] = hdr;
     }
 
-    ff_veth_process_packet(ctx->ifp, hdr);
+    ff_veth_process_packets(ctx->ifp, hdrs, nb_hdrs);
 }
 
 static enum FilterReturn
@@ -1447,123 +1806,422 @@ ff_add_vlan_tag(struct rte_mbuf * rtem)
     }
 }
 
+/*
+ * Enqueue a group of packets to the dispatch ring of another queue,
+ * packets that don't fit in the ring are dropped.
+ */
 static inline void
-process_packets(uint16_t port_id, uint16_t queue_id, struct rte_mbuf **bufs,
-    uint16_t count, const struct ff_dpdk_if_context *ctx, int pkts_from_ring)
+dispatch_ring_enqueue_burst(uint16_t port_id, uint16_t queue_id,
+    struct rte_mbuf **pkts, uint16_t count)
 {
-    struct lcore_conf *qconf = &lcore_conf;
-    uint16_t nb_queues = qconf->nb_queue_list[port_id];
+    uint16_t ret;
+
+    ret = rte_ring_enqueue_burst(dispatch_ring[port_id][queue_id],
+        (void **)pkts, count, NULL);
+    if (likely(ret == count))
+        return;
+
+    ff_stats->port[port_id].dispatch_dropped += count - ret;
+    if (queue_id < FF_MAX_DISPATCH_QUEUES)
+        ff_stats->port[port_id].dispatch_dropped_to[queue_id] += count - ret;
+    for (; ret < count; ret++) {
+        rte_pktmbuf_free(pkts[ret]);
+    }
+}
+
+/*
+ * Hand the packets steered to other queues by the dispatcher to their
+ * rings, one burst per destination queue.
+ */
+static inline void
+dispatch_packets(uint16_t port_id, struct rte_mbuf **pkts, uint16_t *queues,
+    uint16_t count)
+{
+    struct rte_mbuf *group[MAX_PKT_BURST];
+    uint16_t i, j, nb_group, qid;
 
-    uint16_t i;
     for (i = 0; i < count; i++) {
-        struct rte_mbuf *rtem = bufs[i];
+        if (pkts[i] == NULL)
+            continue;
 
-        if (unlikely( ff_global_cfg.pcap.enable)) {
-            if (!pkts_from_ring) {
-                ff_dump_packets( ff_global_cfg.pcap.save_path, rtem, ff_global_cfg.pcap.snap_len, ff_global_cfg.pcap.save_len);
+        qid = queues[i];
+        nb_group = 0;
+        for (j = i; j < count; j++) {
+            if (pkts[j] != NULL && queues[j] == qid) {
+                group[nb_group++] = pkts[j];
+                pkts[j] = NULL;
             }
         }
 
-        void *data = rte_pktmbuf_mtod(rtem, void*);
-        uint16_t len = rte_pktmbuf_data_len(rtem);
+        dispatch_ring_enqueue_burst(port_id, qid, group, nb_group);
+    }
+}
 
-        if (!pkts_from_ring) {
-            ff_traffic.rx_packets += rtem->nb_segs;
-            ff_traffic.rx_bytes += rte_pktmbuf_pkt_len(rtem);
-        }
+/*
+ * Share ARP/NDP packets with the other queues of this port: every sibling
+ * ring gets a reference to the same mbuf instead of a deep copy of it.
+ * Only the lcores whose stack would modify the frame copy it, see
+ * unshare_neigh_packets().
+ */
+static inline void
+replicate_neigh_packets(uint16_t port_id, uint16_t queue_id,
+    struct rte_mbuf **pkts, uint16_t count)
+{
+    uint16_t nb_queues = lcore_conf.nb_queue_list[port_id];
+    struct rte_mbuf *m;
+    uint16_t i, j;
 
-        if (!pkts_from_ring && packet_dispatcher) {
-            uint64_t cur_tsc = rte_rdtsc();
-            int ret = (*packet_dispatcher)(data, &len, queue_id, nb_queues);
-            usr_cb_tsc += rte_rdtsc() - cur_tsc;
-            if (ret == FF_DISPATCH_RESPONSE) {
-                rte_pktmbuf_pkt_len(rtem) = rte_pktmbuf_data_len(rtem) = len;
-                /*
-                 * We have not support vlan out strip
-                 */
-                ff_add_vlan_tag(rtem);
-                send_single_packet(rtem, port_id);
-                continue;
-            }
+    if (nb_queues <= 1)
+        return;
 
-            if (ret == FF_DISPATCH_ERROR || ret >= nb_queues) {
-                rte_pktmbuf_free(rtem);
-                continue;
-            }
+    for (i = 0; i < count; i++) {
+        for (m = pkts[i]; m != NULL; m = m->next)
+            rte_mbuf_refcnt_update(m, nb_queues - 1);
+    }
 
-            if (ret != queue_id) {
-                ret = rte_ring_enqueue(dispatch_ring[port_id][ret], rtem);
-                if (ret < 0)
-                    rte_pktmbuf_free(rtem);
+    for (j = 0; j < nb_queues; ++j) {
+        if (j == queue_id)
+            continue;
 
-                continue;
-            }
-        }
+        dispatch_ring_enqueue_burst(port_id, j, pkts, count);
+    }
+}
 
-        enum FilterReturn filter = protocol_filter(data, len);
-#ifdef INET6
-        if (filter == FILTER_ARP || filter == FILTER_NDP) {
-#else
-        if (filter == FILTER_ARP) {
-#endif
-            struct rte_mempool *mbuf_pool;
-            struct rte_mbuf *mbuf_clone;
-            if (!pkts_from_ring) {
-                uint16_t j;
-                for(j = 0; j < nb_queues; ++j) {
-                    if(j == queue_id)
-                        continue;
-
-                    unsigned socket_id = 0;
-                    if (numa_on) {
-                        uint16_t lcore_id = qconf->port_cfgs[port_id].lcore_list[j];
-                        socket_id = rte_lcore_to_socket_id(lcore_id);
-                    }
-                    mbuf_pool = pktmbuf_pool[socket_id];
-                    mbuf_clone = pktmbuf_deep_clone(rtem, mbuf_pool);
-                    if(mbuf_clone) {
-                        int ret = rte_ring_enqueue(dispatch_ring[port_id][j],
-                            mbuf_clone);
-                        if (ret < 0)
-                            rte_pktmbuf_free(mbuf_clone);
-                    }
-                }
+/*
+ * Whether the stack writes into this neighbor frame: ARP requests may be
+ * turned into replies in place, in-band VLAN tags are stripped by moving
+ * the ethernet header and IPv6 gets the scope of link-local addresses
+ * embedded.  ARP replies, gratuitous ones included, are only read.
+ */
+static inline int
+neigh_packet_rewritten(const struct rte_mbuf *m)
+{
+    const struct rte_ether_hdr *hdr;
+    const struct rte_arp_hdr *arp;
+
+    hdr = rte_pktmbuf_mtod(m, const struct rte_ether_hdr *);
+    if (hdr->ether_type != rte_cpu_to_be_16(RTE_ETHER_TYPE_ARP))
+        return 1;
+
+    if (rte_pktmbuf_data_len(m) < sizeof(*hdr) + sizeof(*arp))
+        return 1;
+
+    arp = (const struct rte_arp_hdr *)(hdr + 1);
+    return arp->arp_opcode != rte_cpu_to_be_16(RTE_ARP_OP_REPLY);
+}
+
+/*
+ * Before a burst goes up the stack, give every replicated neighbor frame
+ * that is still shared and would be modified a private copy.  Returns the
+ * new number of packets, those we failed to copy are dropped.
+ */
+static inline uint16_t
+unshare_neigh_packets(uint16_t port_id, struct rte_mbuf **pkts,
+    uint16_t count)
+{
+    struct rte_mempool *mbuf_pool = pktmbuf_pool[lcore_conf.socket_id];
+    struct rte_mbuf *m, *mc;
+    uint16_t i, nb = 0;
+
+    for (i = 0; i < count; i++) {
+        m = pkts[i];
+        if (rte_mbuf_refcnt_read(m) > 1 && neigh_packet_rewritten(m)) {
+            mc = rte_pktmbuf_copy(m, mbuf_pool, 0, UINT32_MAX);
+            rte_pktmbuf_free(m);
+            if (mc == NULL) {
+                ff_stats->port[port_id].rx_dropped++;
+                continue;
             }
+            m = mc;
+        }
+        pkts[nb++] = m;
+    }
+
+    return nb;
+}
+
+/*
+ * Whether a packet of a moved RETA bucket belongs to this queue: anything
+ * but TCP, new connections and the connections the stack already has,
+ * including the handshakes in its syncache.
+ */
+static int
+reta_packet_is_local(struct rte_mbuf *m, const struct ff_dpdk_if_context *ctx)
+{
+    uint8_t *data = rte_pktmbuf_mtod(m, uint8_t *);
+    uint16_t len = rte_pktmbuf_data_len(m);
+    const struct rte_ether_hdr *hdr = (const struct rte_ether_hdr *)data;
+    const struct rte_tcp_hdr *th;
+    uint16_t ether_type = hdr->ether_type;
+    uint16_t off = RTE_ETHER_HDR_LEN;
+    const void *saddr, *daddr;
+    int ipv6;
+
+    if (ether_type == rte_cpu_to_be_16(RTE_ETHER_TYPE_VLAN)) {
+        const struct rte_vlan_hdr *vh =
+            (const struct rte_vlan_hdr *)(data + off);
+        ether_type = vh->eth_proto;
+        off += sizeof(struct rte_vlan_hdr);
+    }
+
+    if (ether_type == rte_cpu_to_be_16(RTE_ETHER_TYPE_IPV4)) {
+        const struct rte_ipv4_hdr *iph;
+
+        if (len < off + sizeof(struct rte_ipv4_hdr)) {
+            return 1;
+        }
+        iph = (const struct rte_ipv4_hdr *)(data + off);
+        if (iph->next_proto_id != IPPROTO_TCP ||
+            (iph->fragment_offset & rte_cpu_to_be_16(RTE_IPV4_HDR_MF_FLAG |
+            RTE_IPV4_HDR_OFFSET_MASK))) {
+            return 1;
+        }
+        off += rte_ipv4_hdr_len(iph);
+        saddr = &iph->src_addr;
+        daddr = &iph->dst_addr;
+        ipv6 = 0;
+#ifdef INET6
+    } else if (ether_type == rte_cpu_to_be_16(RTE_ETHER_TYPE_IPV6)) {
+        const struct rte_ipv6_hdr *ip6h;
+
+        if (len < off + sizeof(struct rte_ipv6_hdr)) {
+            return 1;
+        }
+        ip6h = (const struct rte_ipv6_hdr *)(data + off);
+        if (ip6h->proto != IPPROTO_TCP) {
+            return 1;
+        }
+        off += sizeof(struct rte_ipv6_hdr);
+        saddr = ip6h->src_addr;
+        daddr = ip6h->dst_addr;
+        ipv6 = 1;
+#endif
+    } else {
+        return 1;
+    }
+
+    if (len < off + sizeof(struct rte_tcp_hdr)) {
+        return 1;
+    }
+    th = (const struct rte_tcp_hdr *)(data + off);
+    if ((th->tcp_flags & (RTE_TCP_SYN_FLAG | RTE_TCP_ACK_FLAG)) ==
+        RTE_TCP_SYN_FLAG) {
+        return 1;
+    }
+
+    return ff_veth_tcp_lookup(ctx->ifp, ipv6, saddr, daddr, th->src_port,
+        th->dst_port);
+}
+
+/*
+ * Count the packet in its RETA bucket, return the previous queue of the
+ * bucket if the packet has to be handed back to it, or -1.
+ */
+static inline int
+reta_handoff_queue(uint16_t port_id, uint16_t queue_id, struct rte_mbuf *m,
+    const struct ff_dpdk_if_context *ctx)
+{
+    struct ff_reta *reta = &reta_tables[port_id];
+    uint32_t bucket;
+    uint16_t prev;
+
+    if (!reta->enabled || !(m->ol_flags & RTE_MBUF_F_RX_RSS_HASH)) {
+        return -1;
+    }
+
+    bucket = m->hash.rss & (rss_reta_size[port_id] - 1);
+    ff_stats->port[port_id].reta_packets[bucket]++;
+
+    prev = reta->prev[bucket];
+    if (likely(prev == FF_RETA_NO_HANDOFF) || prev == queue_id ||
+        reta_packet_is_local(m, ctx)) {
+        return -1;
+    }
+
+    ff_stats->port[port_id].reta_handoff[bucket]++;
+    return prev;
+}
 
+/*
+ * Process a burst of packets: classify the whole burst first, grouping
+ * packets by verdict, then hand each group to the dispatch rings, KNI or
+ * the stack in bulk.
+ */
+static inline void
+process_packets(uint16_t port_id, uint16_t queue_id, struct rte_mbuf **bufs,
+    uint16_t count, const struct ff_dpdk_if_context *ctx, int pkts_from_ring)
+{
+    struct lcore_conf *qconf = &lcore_conf;
+    uint16_t nb_queues = qconf->nb_queue_list[port_id];
+    struct rte_mbuf *stack_pkts[MAX_PKT_BURST];
+    struct rte_mbuf *neigh_pkts[MAX_PKT_BURST];
+    struct rte_mbuf *disp_pkts[MAX_PKT_BURST];
+    uint16_t disp_queues[MAX_PKT_BURST];
+    uint16_t nb_stack = 0, nb_neigh = 0, nb_disp = 0;
+    void *burst_data[MAX_PKT_BURST];
+    uint16_t burst_len[MAX_PKT_BURST];
+    int verdicts[MAX_PKT_BURST];
 #ifdef FF_KNI
-            if (enable_kni && rte_eal_process_type() == RTE_PROC_PRIMARY) {
-                mbuf_pool = pktmbuf_pool[qconf->socket_id];
-                mbuf_clone = pktmbuf_deep_clone(rtem, mbuf_pool);
-                if(mbuf_clone) {
-                    ff_add_vlan_tag(mbuf_clone);
-                    ff_kni_enqueue(port_id, mbuf_clone);
-                }
+    struct rte_mbuf *kni_pkts[MAX_PKT_BURST];
+    uint16_t nb_kni = 0;
+#endif
+
+    uint16_t i;
+
+    /* Prefetch first packets */
+    for (i = 0; i < PREFETCH_OFFSET && i < count; i++) {
+        rte_prefetch0(rte_pktmbuf_mtod(bufs[i], void *));
+    }
+
+    if (unlikely(ff_global_cfg.pcap.enable) && !pkts_from_ring) {
+        for (i = 0; i < count; i++) {
+            ff_dump_packets(ff_global_cfg.pcap.save_path, bufs[i],
+                ff_global_cfg.pcap.snap_len, ff_global_cfg.pcap.save_len);
+        }
+    }
+
+    /* Get the verdicts of the whole burst with a single callback */
+    if (!pkts_from_ring && packet_dispatcher_burst) {
+        for (i = 0; i < count; i++) {
+            burst_data[i] = rte_pktmbuf_mtod(bufs[i], void *);
+            burst_len[i] = rte_pktmbuf_data_len(bufs[i]);
+        }
+
+        uint64_t cur_tsc = rte_rdtsc();
+        (*packet_dispatcher_burst)(burst_data, burst_len, verdicts, count,
+            queue_id, nb_queues);
+        usr_cb_tsc += rte_rdtsc() - cur_tsc;
+    }
+
+    for (i = 0; i < count; i++) {
+        struct rte_mbuf *rtem = bufs[i];
+
+        if (i + PREFETCH_OFFSET < count) {
+            rte_prefetch0(rte_pktmbuf_mtod(bufs[i + PREFETCH_OFFSET],
+                void *));
+        }
+
+        void *data = rte_pktmbuf_mtod(rtem, void*);
+        uint16_t len = rte_pktmbuf_data_len(rtem);
+
+        if (!pkts_from_ring) {
+            ff_stats->traffic.rx_packets += rtem->nb_segs;
+            ff_stats->traffic.rx_bytes += rte_pktmbuf_pkt_len(rtem);
+            ff_stats->port[port_id].rx_packets++;
+            ff_stats->port[port_id].rx_bytes += rte_pktmbuf_pkt_len(rtem);
+        }
+
+        if (!pkts_from_ring && (packet_dispatcher_burst || packet_dispatcher)) {
+            int ret;
+
+            if (packet_dispatcher_burst) {
+                ret = verdicts[i];
+                len = burst_len[i];
+            } else {
+                uint64_t cur_tsc = rte_rdtsc();
+                ret = (*packet_dispatcher)(data, &len, queue_id, nb_queues);
+                usr_cb_tsc += rte_rdtsc() - cur_tsc;
+            }
+
+            if (ret == FF_DISPATCH_RESPONSE) {
+                rte_pktmbuf_pkt_len(rtem) = rte_pktmbuf_data_len(rtem) = len;
+                /*
+                 * We have not support vlan out strip
+                 */
+                ff_add_vlan_tag(rtem);
+                send_single_packet(rtem, port_id);
+                continue;
             }
+
+            if (ret < 0 || ret >= nb_queues) {
+                rte_pktmbuf_free(rtem);
+                continue;
+            }
+
+            if (ret != queue_id) {
+                disp_queues[nb_disp] = ret;
+                disp_pkts[nb_disp++] = rtem;
+                continue;
+            }
+        } else if (reta_rebalance_ms && !pkts_from_ring) {
+            int ret = reta_handoff_queue(port_id, queue_id, rtem, ctx);
+
+            if (ret >= 0) {
+                disp_queues[nb_disp] = ret;
+                disp_pkts[nb_disp++] = rtem;
+                continue;
+            }
+        }
+
+        enum FilterReturn filter = protocol_filter(data, len);
+#ifdef INET6
+        if (filter == FILTER_ARP || filter == FILTER_NDP) {
+#else
+        if (filter == FILTER_ARP) {
 #endif
-            ff_veth_input(ctx, rtem);
+            neigh_pkts[nb_neigh++] = rtem;
+            stack_pkts[nb_stack++] = rtem;
 #ifdef FF_KNI
         } else if (enable_kni) {
             if (knictl_action == FF_KNICTL_ACTION_ALL_TO_KNI){
                 ff_add_vlan_tag(rtem);
-                ff_kni_enqueue(port_id, rtem);
+                kni_pkts[nb_kni++] = rtem;
             } else if (knictl_action == FF_KNICTL_ACTION_ALL_TO_FF){
-                ff_veth_input(ctx, rtem);
+                stack_pkts[nb_stack++] = rtem;
             } else if (knictl_action == FF_KNICTL_ACTION_DEFAULT){
                 if (enable_kni &&
                         ((filter == FILTER_KNI && kni_accept) ||
                         (filter == FILTER_UNKNOWN && !kni_accept)) ) {
                     ff_add_vlan_tag(rtem);
-                    ff_kni_enqueue(port_id, rtem);
+                    kni_pkts[nb_kni++] = rtem;
                 } else {
-                    ff_veth_input(ctx, rtem);
+                    stack_pkts[nb_stack++] = rtem;
                 }
             } else {
-                ff_veth_input(ctx, rtem);
+                stack_pkts[nb_stack++] = rtem;
             }
 #endif
         } else {
-            ff_veth_input(ctx, rtem);
+            stack_pkts[nb_stack++] = rtem;
+        }
+    }
+
+    if (nb_disp > 0) {
+        dispatch_packets(port_id, disp_pkts, disp_queues, nb_disp);
+    }
+
+    if (nb_neigh > 0) {
+        if (!pkts_from_ring) {
+            replicate_neigh_packets(port_id, queue_id, neigh_pkts, nb_neigh);
         }
+
+#ifdef FF_KNI
+        if (enable_kni && rte_eal_process_type() == RTE_PROC_PRIMARY) {
+            struct rte_mempool *mbuf_pool = pktmbuf_pool[qconf->socket_id];
+            for (i = 0; i < nb_neigh; i++) {
+                struct rte_mbuf *mbuf_clone;
+                mbuf_clone = pktmbuf_deep_clone(neigh_pkts[i], mbuf_pool);
+                if(mbuf_clone) {
+                    ff_add_vlan_tag(mbuf_clone);
+                    kni_pkts[nb_kni++] = mbuf_clone;
+                }
+            }
+        }
+#endif
+    }
+
+#ifdef FF_KNI
+    if (nb_kni > 0) {
+        ff_kni_enqueue_burst(port_id, kni_pkts, nb_kni);
+    }
+#endif
+
+    if (nb_stack > 0 && nb_neigh > 0 && nb_queues > 1) {
+        nb_stack = unshare_neigh_packets(port_id, stack_pkts, nb_stack);
+    }
+
+    if (nb_stack > 0) {
+        ff_veth_input_burst(ctx, stack_pkts, nb_stack);
     }
 }
 
@@ -1640,7 +2298,7 @@ handle_route_msg(struct ff_msg *msg)
 static inline void
 handle_top_msg(struct ff_msg *msg)
 {
-    msg->top = ff_top_status;
+    msg->top = ff_stats->top;
     msg->result = 0;
 }
 
@@ -1700,7 +2358,7 @@ done:
 static inline void
 handle_traffic_msg(struct ff_msg *msg)
 {
-    msg->traffic = ff_traffic;
+    msg->traffic = ff_stats->traffic;
     msg->result = 0;
 }
 
@@ -1724,6 +2382,31 @@ handle_knictl_msg(struct ff_msg *msg)
 }
 #endif
 
+static inline void
+handle_flow_msg(struct ff_msg *msg)
+{
+    struct ff_flow_args *args = &msg->flow;
+
+    if (rte_eal_process_type() != RTE_PROC_PRIMARY) {
+        msg->result = ENOTSUP;
+        return;
+    }
+
+    switch (args->cmd) {
+        case FF_FLOW_CMD_ADD:
+            msg->result = ff_flow_rule_add(args->port_id, args->proto,
+                args->sport, args->dport, args->queue);
+            break;
+        case FF_FLOW_CMD_DEL:
+            msg->result = ff_flow_rule_del(args->port_id, args->proto,
+                args->sport, args->dport);
+            break;
+        default:
+            msg->result = EINVAL;
+            break;
+    }
+}
+
 static inline void
 handle_default_msg(struct ff_msg *msg)
 {
@@ -1767,6 +2450,9 @@ handle_msg(struct ff_msg *msg, uint16_t proc_id)
             handle_knictl_msg(msg);
             break;
 #endif
+        case FF_FLOW:
+            handle_flow_msg(msg);
+            break;
         default:
             handle_default_msg(msg);
             break;
@@ -1823,10 +2509,13 @@ send_burst(struct lcore_conf *qconf, uint16_t n, uint8_t port)
     }
 
     ret = rte_eth_tx_burst(port, queueid, m_table, n);
-    ff_traffic.tx_packets += ret;
+    ff_stats->traffic.tx_packets += ret;
+    ff_stats->port[port].tx_packets += ret;
+    ff_stats->port[port].tx_dropped += n - ret;
     uint16_t i;
     for (i = 0; i < ret; i++) {
-        ff_traffic.tx_bytes += rte_pktmbuf_pkt_len(m_table[i]);
+        ff_stats->traffic.tx_bytes += rte_pktmbuf_pkt_len(m_table[i]);
+        ff_stats->port[port].tx_bytes += rte_pktmbuf_pkt_len(m_table[i]);
 #ifdef FF_USE_PAGE_ARRAY
         if (qconf->tx_mbufs[port].bsd_m_table[i])
             ff_enq_tx_bsdmbuf(port, qconf->tx_mbufs[port].bsd_m_table[i], m_table[i]->nb_segs);
@@ -1866,98 +2555,411 @@ send_single_packet(struct rte_mbuf *m, uint8_t port)
     return 0;
 }
 
-int
-ff_dpdk_if_send(struct ff_dpdk_if_context *ctx, void *m,
-    int total)
+/*
+ * Walk the IPv6 extension headers, return the length of the whole L3 header
+ * and the upper layer protocol in *proto.
+ */
+static inline int
+ff_ipv6_hdr_len(struct rte_ipv6_hdr *ip6h, uint8_t *proto)
 {
-#ifdef FF_USE_PAGE_ARRAY
-    struct lcore_conf *qconf = &lcore_conf;
-    int    len = 0;
+    uint8_t *ext = (uint8_t *)(ip6h + 1);
+    uint8_t nxt = ip6h->proto;
+    int len = sizeof(struct rte_ipv6_hdr);
+    int ext_len;
+
+    for (;;) {
+        switch (nxt) {
+        case IPPROTO_HOPOPTS:
+        case IPPROTO_ROUTING:
+        case IPPROTO_DSTOPTS:
+            ext_len = (ext[1] + 1) << 3;
+            break;
+        case IPPROTO_FRAGMENT:
+            ext_len = 8;
+            break;
+        case IPPROTO_AH:
+            ext_len = (ext[1] + 2) << 2;
+            break;
+        default:
+            *proto = nxt;
+            return len;
+        }
 
-    len = ff_if_send_onepkt(ctx, m,total);
-    if (unlikely(len == MAX_PKT_BURST)) {
-        send_burst(qconf, MAX_PKT_BURST, ctx->port_id);
-        len = 0;
+        nxt = ext[0];
+        ext += ext_len;
+        len += ext_len;
     }
-    qconf->tx_mbufs[ctx->port_id].len = len;
-    return 0;
-#endif
-    struct rte_mempool *mbuf_pool = pktmbuf_pool[lcore_conf.socket_id];
-    struct rte_mempool *ref_pool = pktmbuf_ref_pool[lcore_conf.socket_id];
-    struct rte_mbuf *head = NULL, *first = NULL;
-    void *mbuf = m;
-    void *data = NULL;
-    unsigned len = 0;
+}
 
-    /* Check whether there is already an rte_mbuf containing the payload */
-    ff_next_mbuf(&mbuf, &data, &len);
-    if (mbuf && ff_rte_frm_extcl(mbuf)) {
-        /* Allocate and configure head buffer and copy headers to it */
-        head = rte_pktmbuf_alloc(mbuf_pool);
-        if (head == NULL) {
-            fprintf(stderr, "Error allocating head rte_mbuf, handle it\n");
-            return -1;
-        }
-        head->data_len = len;
-        head->pkt_len = total;
-        head->nb_segs = 1;
-        int ret = ff_mbuf_copydata(m, rte_pktmbuf_mtod(head, void *), 0, len);
-        if (ret < 0) {
-            fprintf(stderr, "Error copying headers to rte_mbuf\n");
-            return -1;
-        }
+void
+ff_dpdk_tx_offload_set(struct rte_mbuf *head, struct ff_tx_offload *offload,
+    uint8_t tx_csum_l4)
+{
+    void *data = rte_pktmbuf_mtod(head, void *);
+    struct rte_ether_hdr *eh = (struct rte_ether_hdr *)data;
+    struct rte_ipv4_hdr *iph = NULL;
+    struct rte_ipv6_hdr *ip6h = NULL;
+    void *l3 = (char *)data + RTE_ETHER_HDR_LEN;
+    uint8_t proto = 0;
+    int l3_len;
+
+    if (!offload->ip_csum && !(tx_csum_l4 && (offload->tcp_csum ||
+        offload->udp_csum || offload->tso_seg_size))) {
+        return;
+    }
 
-        /* Append remaining segments to the chain */
-        struct rte_mbuf *tail = head;
-        while (mbuf) {
-            struct rte_mbuf *original = ff_rte_frm_extcl(mbuf);
-            if (!original) {
-                fprintf(stderr, "Error retrieving rte_mbuf connect to bsd "
-                        "mbuf\n");
-                return -1;
-            }
+    if (eh->ether_type == rte_cpu_to_be_16(RTE_ETHER_TYPE_IPV6)) {
+        ip6h = (struct rte_ipv6_hdr *)l3;
+        l3_len = ff_ipv6_hdr_len(ip6h, &proto);
+    } else {
+        iph = (struct rte_ipv4_hdr *)l3;
+        l3_len = (iph->version_ihl & 0x0f) << 2;
+    }
 
-            ff_next_mbuf(&mbuf, &data, &len);
+    head->l2_len = RTE_ETHER_HDR_LEN;
+    head->l3_len = l3_len;
 
-            /* Use a (shallow) mbuf clone to TX data, so we can keep the
-             * original mbuf in the socket tx ringbuf
-             */
-            struct rte_mbuf *clone = rte_pktmbuf_clone(original, ref_pool);
-            if (!clone) {
-                fprintf(stderr, "Error getting shallow mbuf for TX\n");
-                return -1;
-            }
-            clone->data_len = len;
-            clone->data_off = data - clone->buf_addr;
+    if (iph != NULL && offload->ip_csum) {
+        head->ol_flags |= RTE_MBUF_F_TX_IP_CKSUM | RTE_MBUF_F_TX_IPV4;
+    }
 
-            tail->next = clone;
-            tail = clone;
-            head->nb_segs++;
-        }
-        tail->next = NULL;
+    if (!tx_csum_l4) {
+        return;
+    }
 
-    /* Normal packet processing for packets other than data packets */
-    } else {
-        head = rte_pktmbuf_alloc(mbuf_pool);
-        if (head == NULL) {
-            ff_mbuf_free(m);
-            return -1;
+    if (offload->tcp_csum) {
+        head->ol_flags |= RTE_MBUF_F_TX_TCP_CKSUM;
+    }
+
+    /*
+     *  TCP segmentation offload.
+     *
+     *  - set the PKT_TX_TCP_SEG flag in mbuf->ol_flags (this flag
+     *    implies PKT_TX_TCP_CKSUM)
+     *  - set the flag PKT_TX_IPV4 or PKT_TX_IPV6
+     *  - if it's IPv4, set the PKT_TX_IP_CKSUM flag and
+     *    write the IP checksum to 0 in the packet
+     *  - fill the mbuf offload information: l2_len,
+     *    l3_len, l4_len, tso_segsz
+     *  - calculate the pseudo header checksum without taking ip_len
+     *    in account, and set it in the TCP header. Refer to
+     *    rte_ipv4_phdr_cksum() and rte_ipv6_phdr_cksum() that can be
+     *    used as helpers.
+     */
+    if (offload->tso_seg_size) {
+        struct rte_tcp_hdr *tcph;
+        int tcph_len;
+        tcph = (struct rte_tcp_hdr *)((char *)l3 + l3_len);
+        tcph_len = (tcph->data_off & 0xf0) >> 2;
+
+        if (ip6h != NULL) {
+            /* The pseudo header takes the upper layer protocol */
+            struct rte_ipv6_hdr phdr = *ip6h;
+            phdr.proto = proto;
+            tcph->cksum = rte_ipv6_phdr_cksum(&phdr, RTE_MBUF_F_TX_TCP_SEG);
+        } else {
+            tcph->cksum = rte_ipv4_phdr_cksum(iph, RTE_MBUF_F_TX_TCP_SEG);
         }
 
-        head->pkt_len = total;
-        head->nb_segs = 0;
+        head->ol_flags |= RTE_MBUF_F_TX_TCP_SEG;
+        head->l4_len = tcph_len;
+        head->tso_segsz = offload->tso_seg_size;
+    }
 
-        int off = 0;
-        struct rte_mbuf *cur = head, *prev = NULL;
+    if (offload->udp_csum) {
+        head->ol_flags |= RTE_MBUF_F_TX_UDP_CKSUM;
+    }
 
-        while(total > 0) {
-            if (cur == NULL) {
-                cur = rte_pktmbuf_alloc(mbuf_pool);
-                if (cur == NULL) {
-                    rte_pktmbuf_free(head);
-                    ff_mbuf_free(m);
-                    return -1;
-                }
+    if (ip6h != NULL) {
+        head->ol_flags |= RTE_MBUF_F_TX_IPV6;
+    } else if (head->ol_flags & RTE_MBUF_F_TX_L4_MASK ||
+        head->ol_flags & RTE_MBUF_F_TX_TCP_SEG) {
+        head->ol_flags |= RTE_MBUF_F_TX_IPV4;
+    }
+}
+
+/*
+ * Stage a TSO frame like any other packet, and remember the port so that
+ * tx_tso_flush() sends it at the end of the burst or loop, without waiting
+ * for pkt_tx_delay or a full burst.
+ */
+static inline int
+send_tso_packet(struct rte_mbuf *m, uint8_t port)
+{
+    tx_tso_staged[port] = 1;
+    tx_tso_pending = 1;
+
+    return send_single_packet(m, port);
+}
+
+/* One rte_eth_tx_burst per port that staged TSO frames */
+static inline void
+tx_tso_flush(struct lcore_conf *qconf)
+{
+    uint16_t port_id;
+    int i;
+
+    if (likely(!tx_tso_pending)) {
+        return;
+    }
+    tx_tso_pending = 0;
+
+    for (i = 0; i < qconf->nb_tx_port; i++) {
+        port_id = qconf->tx_port_id[i];
+        if (!tx_tso_staged[port_id]) {
+            continue;
+        }
+        tx_tso_staged[port_id] = 0;
+
+        if (qconf->tx_mbufs[port_id].len == 0) {
+            continue;
+        }
+
+        send_burst(qconf, qconf->tx_mbufs[port_id].len, port_id);
+        qconf->tx_mbufs[port_id].len = 0;
+    }
+}
+
+static inline struct rte_mbuf *
+tx_mbuf_cache_get(struct tx_mbuf_cache *cache, struct rte_mempool *mp)
+{
+    if (unlikely(cache->len == 0)) {
+        if (rte_pktmbuf_alloc_bulk(mp, cache->m, TX_MBUF_CACHE_SIZE) < 0) {
+            return rte_pktmbuf_alloc(mp);
+        }
+        cache->len = TX_MBUF_CACHE_SIZE;
+    }
+
+    return cache->m[--cache->len];
+}
+
+/*
+ * A buffer attached by ff_zc_mbuf_attach() in DPDK memory is sent as an
+ * external buffer of the rte_mbuf, which holds a reference on the BSD mbuf
+ * until the NIC is done with it, instead of being copied.
+ */
+struct tx_zc_ref {
+    struct rte_mbuf_ext_shared_info shinfo;
+    void *bsd_ref;
+    struct tx_zc_ref *next;
+};
+
+static struct tx_zc_ref *tx_zc_ref_free;
+
+static void
+tx_zc_ref_release(void *addr __rte_unused, void *opaque)
+{
+    struct tx_zc_ref *ref = opaque;
+
+    ff_zc_mbuf_tx_unref(ref->bsd_ref);
+    ref->bsd_ref = NULL;
+    ref->next = tx_zc_ref_free;
+    tx_zc_ref_free = ref;
+}
+
+/* IOVA of data if the NIC can read len bytes there, else RTE_BAD_IOVA */
+static rte_iova_t
+tx_zc_iova(void *data, unsigned len)
+{
+    const struct rte_memseg *ms;
+    char *next, *end = (char *)data + len;
+    rte_iova_t iova;
+
+    ms = rte_mem_virt2memseg(data, NULL);
+    if (ms == NULL || ms->iova == RTE_BAD_IOVA) {
+        return RTE_BAD_IOVA;
+    }
+    iova = ms->iova + ((char *)data - (char *)ms->addr);
+
+    /* Pages crossed must be contiguous in IOVA too */
+    next = (char *)ms->addr + ms->len;
+    while (next < end) {
+        ms = rte_mem_virt2memseg(next, NULL);
+        if (ms == NULL || ms->iova != iova + (next - (char *)data)) {
+            return RTE_BAD_IOVA;
+        }
+        next = (char *)ms->addr + ms->len;
+    }
+
+    return iova;
+}
+
+static struct rte_mbuf *
+tx_zc_mbuf(void *bsd_mbuf, void *data, unsigned len, struct rte_mempool *mp)
+{
+    struct tx_zc_ref *ref;
+    struct rte_mbuf *m;
+    rte_iova_t iova;
+
+    if (len == 0 || len > UINT16_MAX || !ff_zc_mbuf_attached(bsd_mbuf)) {
+        return NULL;
+    }
+
+    iova = tx_zc_iova(data, len);
+    if (iova == RTE_BAD_IOVA) {
+        return NULL;
+    }
+
+    ref = tx_zc_ref_free;
+    if (ref != NULL) {
+        tx_zc_ref_free = ref->next;
+    } else {
+        ref = rte_malloc(NULL, sizeof(struct tx_zc_ref), 0);
+        if (ref == NULL) {
+            return NULL;
+        }
+        ref->shinfo.free_cb = tx_zc_ref_release;
+        ref->shinfo.fcb_opaque = ref;
+    }
+
+    m = tx_mbuf_cache_get(&tx_ref_cache, mp);
+    if (m == NULL) {
+        goto fail;
+    }
+
+    ref->bsd_ref = ff_zc_mbuf_tx_ref(bsd_mbuf);
+    if (ref->bsd_ref == NULL) {
+        rte_pktmbuf_free(m);
+        goto fail;
+    }
+
+    rte_mbuf_ext_refcnt_set(&ref->shinfo, 1);
+    rte_pktmbuf_attach_extbuf(m, data, iova, len, &ref->shinfo);
+    m->data_len = len;
+
+    return m;
+
+fail:
+    ref->next = tx_zc_ref_free;
+    tx_zc_ref_free = ref;
+    return NULL;
+}
+
+int
+ff_dpdk_if_send(struct ff_dpdk_if_context *ctx, void *m,
+    int total)
+{
+#ifdef FF_USE_PAGE_ARRAY
+    struct lcore_conf *qconf = &lcore_conf;
+    int    len = 0;
+
+    len = ff_if_send_onepkt(ctx, m,total);
+    if (unlikely(len == MAX_PKT_BURST)) {
+        send_burst(qconf, MAX_PKT_BURST, ctx->port_id);
+        len = 0;
+    }
+    qconf->tx_mbufs[ctx->port_id].len = len;
+    return 0;
+#endif
+    struct rte_mempool *mbuf_pool = pktmbuf_pool[lcore_conf.socket_id];
+    struct rte_mempool *ref_pool = pktmbuf_ref_pool[lcore_conf.socket_id];
+    struct rte_mbuf *head = NULL;
+    void *mbuf = m;
+    void *data = NULL;
+    unsigned len = 0;
+
+    /* Check whether there is already an rte_mbuf containing the payload */
+    ff_next_mbuf(&mbuf, &data, &len);
+    if (mbuf && (ff_rte_frm_extcl(mbuf) || ff_zc_mbuf_attached(mbuf))) {
+        /* Allocate and configure head buffer and copy headers to it */
+        head = tx_mbuf_cache_get(&tx_head_cache, mbuf_pool);
+        if (head == NULL) {
+            ff_stats->port[ctx->port_id].tx_nombuf++;
+            ff_mbuf_free(m);
+            return -1;
+        }
+        head->data_len = len;
+        head->pkt_len = total;
+        head->nb_segs = 1;
+        rte_memcpy(rte_pktmbuf_mtod(head, void *), data, len);
+
+        /*
+         * Append remaining segments to the chain in a single pass, attaching
+         * an indirect mbuf to each payload rte_mbuf, so we can keep the
+         * original mbuf in the socket tx ringbuf.
+         */
+        struct rte_mbuf *tail = head;
+        while (mbuf) {
+            struct rte_mbuf *original = ff_rte_frm_extcl(mbuf);
+            struct rte_mbuf *clone;
+            void *cur = mbuf;
+
+            ff_next_mbuf(&mbuf, &data, &len);
+
+            if (unlikely(original == NULL)) {
+                clone = tx_zc_mbuf(cur, data, len, ref_pool);
+                if (clone != NULL) {
+                    tail->next = clone;
+                    tail = clone;
+                    head->nb_segs++;
+                    continue;
+                }
+
+                /*
+                 * Payload not backed by an rte_mbuf, copy it, over several
+                 * mbufs if it is larger than one, e.g. a 4KB cluster.
+                 */
+                while (len > 0) {
+                    unsigned seg;
+
+                    clone = tx_mbuf_cache_get(&tx_head_cache, mbuf_pool);
+                    if (clone == NULL) {
+                        ff_stats->port[ctx->port_id].tx_nombuf++;
+                        goto fail;
+                    }
+
+                    seg = RTE_MIN(len, (unsigned)rte_pktmbuf_tailroom(clone));
+                    rte_memcpy(rte_pktmbuf_mtod(clone, void *), data, seg);
+                    clone->data_len = seg;
+                    data = (char *)data + seg;
+                    len -= seg;
+
+                    tail->next = clone;
+                    tail = clone;
+                    head->nb_segs++;
+                }
+                continue;
+            }
+
+            clone = tx_mbuf_cache_get(&tx_ref_cache, ref_pool);
+            if (clone == NULL) {
+                ff_stats->port[ctx->port_id].tx_nombuf++;
+                goto fail;
+            }
+            rte_pktmbuf_attach(clone, original);
+            clone->data_off = (char *)data - (char *)clone->buf_addr;
+            clone->data_len = len;
+
+            tail->next = clone;
+            tail = clone;
+            head->nb_segs++;
+        }
+        tail->next = NULL;
+
+    /* Normal packet processing for packets other than data packets */
+    } else {
+        head = rte_pktmbuf_alloc(mbuf_pool);
+        if (head == NULL) {
+            ff_stats->port[ctx->port_id].tx_nombuf++;
+            ff_mbuf_free(m);
+            return -1;
+        }
+
+        head->pkt_len = total;
+        head->nb_segs = 0;
+
+        int off = 0;
+        struct rte_mbuf *cur = head, *prev = NULL;
+
+        while(total > 0) {
+            if (cur == NULL) {
+                cur = rte_pktmbuf_alloc(mbuf_pool);
+                if (cur == NULL) {
+                    ff_stats->port[ctx->port_id].tx_nombuf++;
+                    rte_pktmbuf_free(head);
+                    ff_mbuf_free(m);
+                    return -1;
+                }
             }
 
             if (prev != NULL) {
@@ -1985,70 +2987,441 @@ ff_dpdk_if_send(struct ff_dpdk_if_context *ctx, void *m,
 
     struct ff_tx_offload offload = {0};
     ff_mbuf_tx_offload(m, &offload);
+    ff_dpdk_tx_offload_set(head, &offload, ctx->hw_features.tx_csum_l4);
 
-    data = rte_pktmbuf_mtod(head, void*);
+    ff_mbuf_free(m);
 
-    if (offload.ip_csum) {
-        /* ipv6 not supported yet */
-        struct rte_ipv4_hdr *iph;
-        int iph_len;
-        iph = (struct rte_ipv4_hdr *)(data + RTE_ETHER_HDR_LEN);
-        iph_len = (iph->version_ihl & 0x0f) << 2;
+    if (offload.tso_seg_size) {
+        return send_tso_packet(head, ctx->port_id);
+    }
 
-        head->ol_flags |= RTE_MBUF_F_TX_IP_CKSUM | RTE_MBUF_F_TX_IPV4;
-        head->l2_len = RTE_ETHER_HDR_LEN;
-        head->l3_len = iph_len;
+    return send_single_packet(head, ctx->port_id);
+
+fail:
+    rte_pktmbuf_free(head);
+    ff_mbuf_free(m);
+    return -1;
+}
+
+static int
+rx_intr_init(struct lcore_conf *qconf)
+{
+    uint16_t port_id, queue_id;
+    int i, ret;
+
+    if (qconf->nb_rx_queue == 0) {
+        return -1;
     }
 
-    if (ctx->hw_features.tx_csum_l4) {
-        struct rte_ipv4_hdr *iph;
-        int iph_len;
-        iph = (struct rte_ipv4_hdr *)(data + RTE_ETHER_HDR_LEN);
-        iph_len = (iph->version_ihl & 0x0f) << 2;
+    for (i = 0; i < qconf->nb_rx_queue; ++i) {
+        port_id = qconf->rx_queue_list[i].port_id;
+        queue_id = qconf->rx_queue_list[i].queue_id;
 
-        if (offload.tcp_csum) {
-            head->ol_flags |= RTE_MBUF_F_TX_TCP_CKSUM;
-            head->l2_len = RTE_ETHER_HDR_LEN;
-            head->l3_len = iph_len;
+        ret = rte_eth_dev_rx_intr_ctl_q(port_id, queue_id,
+            RTE_EPOLL_PER_THREAD, RTE_INTR_EVENT_ADD, NULL);
+        if (ret != 0) {
+            printf("lcore %u: failed to add RX interrupt of port %u queue %u: %d, "
+                "disable rx_intr\n", rte_lcore_id(), port_id, queue_id, ret);
+            return -1;
         }
+    }
 
-        /*
-         *  TCP segmentation offload.
-         *
-         *  - set the PKT_TX_TCP_SEG flag in mbuf->ol_flags (this flag
-         *    implies PKT_TX_TCP_CKSUM)
-         *  - set the flag PKT_TX_IPV4 or PKT_TX_IPV6
-         *  - if it's IPv4, set the PKT_TX_IP_CKSUM flag and
-         *    write the IP checksum to 0 in the packet
-         *  - fill the mbuf offload information: l2_len,
-         *    l3_len, l4_len, tso_segsz
-         *  - calculate the pseudo header checksum without taking ip_len
-         *    in account, and set it in the TCP header. Refer to
-         *    rte_ipv4_phdr_cksum() and rte_ipv6_phdr_cksum() that can be
-         *    used as helpers.
-         */
-        if (offload.tso_seg_size) {
-            struct rte_tcp_hdr *tcph;
-            int tcph_len;
-            tcph = (struct rte_tcp_hdr *)((char *)iph + iph_len);
-            tcph_len = (tcph->data_off & 0xf0) >> 2;
-            tcph->cksum = rte_ipv4_phdr_cksum(iph, RTE_MBUF_F_TX_TCP_SEG);
+    return 0;
+}
+
+/*
+ * Arm the RX interrupts of all our queues and block until a packet comes,
+ * the next freebsd clock tick is due or sleep_us passed. Only the NIC
+ * wakes us up, so the dispatch and msg rings and the user loop, fed by
+ * other processes, are polled again after at most sleep_us.
+ */
+static void
+rx_intr_wait(struct lcore_conf *qconf, unsigned sleep_us)
+{
+    struct rte_epoll_event events[MAX_RX_QUEUE_PER_LCORE];
+    uint64_t cur_tsc, wait_tsc, tsc_per_ms;
+    int i, timeout;
+
+    cur_tsc = rte_rdtsc();
+    if (freebsd_clock.expire <= cur_tsc) {
+        return;
+    }
+    wait_tsc = RTE_MIN(freebsd_clock.expire - cur_tsc,
+        rte_get_tsc_hz() / US_PER_S * sleep_us);
+    tsc_per_ms = rte_get_tsc_hz() / MS_PER_S;
+    timeout = (wait_tsc + tsc_per_ms - 1) / tsc_per_ms;
+
+    for (i = 0; i < qconf->nb_rx_queue; ++i) {
+        rte_eth_dev_rx_intr_enable(qconf->rx_queue_list[i].port_id,
+            qconf->rx_queue_list[i].queue_id);
+    }
+
+    rte_epoll_wait(RTE_EPOLL_PER_THREAD, events, qconf->nb_rx_queue, timeout);
 
-            head->ol_flags |= RTE_MBUF_F_TX_TCP_SEG;
-            head->l4_len = tcph_len;
-            head->tso_segsz = offload.tso_seg_size;
+    for (i = 0; i < qconf->nb_rx_queue; ++i) {
+        rte_eth_dev_rx_intr_disable(qconf->rx_queue_list[i].port_id,
+            qconf->rx_queue_list[i].queue_id);
+    }
+}
+
+static inline unsigned
+idle_sleep_next(unsigned cur)
+{
+    if (idle_sleep_max <= idle_sleep) {
+        return idle_sleep;
+    }
+
+    if (cur == 0) {
+        return idle_sleep ? idle_sleep : 1;
+    }
+
+    return RTE_MIN(cur << 1, idle_sleep_max);
+}
+
+static inline void
+idle_wait(struct lcore_conf *qconf, unsigned sleep_us)
+{
+    int i;
+
+    /* The interrupt wait has a millisecond granularity, usleep below it */
+    if (rx_intr && sleep_us >= US_PER_S / MS_PER_S &&
+        sleep_us >= RTE_MAX(idle_sleep, idle_sleep_max)) {
+        /* Don't hold staged packets for a whole interrupt wait */
+        for (i = 0; i < qconf->nb_tx_port; i++) {
+            if (qconf->tx_mbufs[qconf->tx_port_id[i]].len)
+                break;
         }
 
-        if (offload.udp_csum) {
-            head->ol_flags |= RTE_MBUF_F_TX_UDP_CKSUM;
-            head->l2_len = RTE_ETHER_HDR_LEN;
-            head->l3_len = iph_len;
+        if (i == qconf->nb_tx_port) {
+            rx_intr_wait(qconf, sleep_us);
+            return;
         }
     }
 
-    ff_mbuf_free(m);
+    usleep(sleep_us);
+}
 
-    return send_single_packet(head, ctx->port_id);
+/* Hash chains of the TCP connections counted in each loop */
+#define FF_RETA_OWNED_CHAINS    64
+
+struct reta_owned_walk {
+    const struct ff_reta *reta;
+    uint16_t reta_size;
+    uint16_t queue_id;
+    uint8_t active;
+    unsigned cursor;
+    uint32_t owned[FF_RETA_SIZE_MAX];
+};
+
+static struct reta_owned_walk *reta_walks;
+static int reta_walks_active;
+
+static void
+reta_owned_count(void *arg, int ipv6, const void *saddr, const void *daddr,
+    uint16_t sport, uint16_t dport)
+{
+    struct reta_owned_walk *walk = arg;
+    unsigned addrlen = ipv6 ? 16 : 4;
+    uint32_t hash, bucket;
+
+    hash = toeplitz_hash(saddr, addrlen, 0) ^
+        toeplitz_hash(daddr, addrlen, addrlen) ^
+        toeplitz_hash((const uint8_t *)&sport, sizeof(sport), 2 * addrlen) ^
+        toeplitz_hash((const uint8_t *)&dport, sizeof(dport),
+        2 * addrlen + sizeof(sport));
+    bucket = hash & (walk->reta_size - 1);
+
+    if (walk->reta->prev[bucket] == walk->queue_id) {
+        walk->owned[bucket]++;
+    }
+}
+
+/*
+ * Every process, count the TCP connections it still has in the buckets
+ * moved away from its queues, the primary retires a handoff only once
+ * there is none left. A count is started every rebalance round and walks
+ * FF_RETA_OWNED_CHAINS hash chains per loop in reta_owned_step(), the
+ * previous count stays published until it is done.
+ */
+static void
+reta_owned_update(void)
+{
+    struct lcore_conf *qconf = &lcore_conf;
+    uint16_t i, b;
+
+    if (reta_walks == NULL) {
+        reta_walks = rte_zmalloc("reta_walks",
+            sizeof(struct reta_owned_walk) * RTE_MAX_ETHPORTS, 0);
+        if (reta_walks == NULL) {
+            return;
+        }
+    }
+
+    for (i = 0; i < qconf->nb_tx_port; i++) {
+        uint16_t port_id = qconf->tx_port_id[i];
+        struct ff_reta *reta = &reta_tables[port_id];
+        struct reta_owned_walk *walk = &reta_walks[port_id];
+        int handoff = 0;
+
+        if (!reta->enabled || walk->active) {
+            continue;
+        }
+
+        walk->reta = reta;
+        walk->reta_size = rss_reta_size[port_id];
+        walk->queue_id = qconf->tx_queue_id[port_id];
+        walk->cursor = 0;
+
+        for (b = 0; b < walk->reta_size; b++) {
+            walk->owned[b] = 0;
+            if (reta->prev[b] == walk->queue_id) {
+                handoff = 1;
+            }
+        }
+
+        if (handoff) {
+            walk->active = 1;
+            reta_walks_active++;
+        } else {
+            memcpy(ff_stats->port[port_id].reta_owned, walk->owned,
+                sizeof(uint32_t) * walk->reta_size);
+        }
+    }
+}
+
+static void
+reta_owned_step(void)
+{
+    struct lcore_conf *qconf = &lcore_conf;
+    uint16_t i;
+
+    for (i = 0; i < qconf->nb_tx_port; i++) {
+        uint16_t port_id = qconf->tx_port_id[i];
+        struct reta_owned_walk *walk = &reta_walks[port_id];
+
+        if (!walk->active || !ff_veth_tcp_foreach(reta_owned_count, walk,
+            &walk->cursor, FF_RETA_OWNED_CHAINS)) {
+            continue;
+        }
+
+        memcpy(ff_stats->port[port_id].reta_owned, walk->owned,
+            sizeof(uint32_t) * walk->reta_size);
+        walk->active = 0;
+        reta_walks_active--;
+    }
+}
+
+/* Primary only, the samples of the last rebalance round */
+struct reta_sample {
+    uint32_t packets[FF_RETA_SIZE_MAX];
+    uint32_t handoff[FF_RETA_SIZE_MAX];
+    uint8_t quiet[FF_RETA_SIZE_MAX];
+};
+
+static struct reta_sample *reta_samples;
+static struct ff_stats *proc_stats[RTE_MAX_LCORE];
+static uint64_t proc_busy_tsc[RTE_MAX_LCORE];
+static uint64_t proc_work_tsc[RTE_MAX_LCORE];
+
+static void
+reta_rebalance_port(uint16_t port_id, const uint32_t *proc_busy)
+{
+    struct ff_reta *reta = &reta_tables[port_id];
+    struct reta_sample *sample = &reta_samples[port_id];
+    uint16_t nb_procs = ff_global_cfg.dpdk.nb_procs;
+    uint16_t nb_queues = ff_global_cfg.dpdk.port_cfgs[port_id].nb_lcores;
+    uint16_t reta_size = rss_reta_size[port_id];
+    struct rte_eth_rss_reta_entry64 reta_conf[FF_RETA_SIZE_MAX /
+        RTE_RETA_GROUP_SIZE];
+    uint32_t busy[DPDK_MAX_LCORE];
+    uint32_t delta[FF_RETA_SIZE_MAX];
+    uint16_t hot = 0, cold = 0, moved = 0;
+    uint64_t hot_packets = 0, budget;
+    int b, best;
+    uint16_t i, q;
+
+    for (q = 0; q < nb_queues; q++) {
+        busy[q] = UINT32_MAX;
+    }
+
+    for (i = 0; i < nb_procs; i++) {
+        struct ff_port_stats *ps;
+
+        if (proc_stats[i] == NULL || proc_busy[i] == UINT32_MAX) {
+            continue;
+        }
+        ps = &proc_stats[i]->port[port_id];
+        if (ps->enabled && ps->queue_id < nb_queues) {
+            busy[ps->queue_id] = proc_busy[i];
+        }
+    }
+
+    /* Packets of each bucket in this round, retire the finished handoffs */
+    for (b = 0; b < reta_size; b++) {
+        uint32_t packets = 0, handoff = 0, owned = 0;
+
+        for (i = 0; i < nb_procs; i++) {
+            if (proc_stats[i] != NULL) {
+                packets += proc_stats[i]->port[port_id].reta_packets[b];
+                handoff += proc_stats[i]->port[port_id].reta_handoff[b];
+                owned += proc_stats[i]->port[port_id].reta_owned[b];
+            }
+        }
+
+        delta[b] = packets - sample->packets[b];
+        sample->packets[b] = packets;
+
+        if (reta->prev[b] != FF_RETA_NO_HANDOFF) {
+            /* Idle connections of the previous queue would be reset */
+            if (handoff != sample->handoff[b] || owned != 0) {
+                sample->quiet[b] = 0;
+            } else if (++sample->quiet[b] >= FF_RETA_HANDOFF_QUIET) {
+                reta->prev[b] = FF_RETA_NO_HANDOFF;
+                sample->quiet[b] = 0;
+            }
+        }
+        sample->handoff[b] = handoff;
+    }
+
+    for (q = 0; q < nb_queues; q++) {
+        /* Wait for all the processes of the port */
+        if (busy[q] == UINT32_MAX) {
+            return;
+        }
+        if (busy[q] > busy[hot]) {
+            hot = q;
+        }
+        if (busy[q] < busy[cold]) {
+            cold = q;
+        }
+    }
+
+    if (busy[hot] < busy[cold] + FF_RETA_MIN_IMBALANCE) {
+        return;
+    }
+
+    for (b = 0; b < reta_size; b++) {
+        if (reta->queue[b] == hot) {
+            hot_packets += delta[b];
+        }
+    }
+
+    /*
+     * Move about half of the difference, an elephant bucket heavier than
+     * that would only move the hot spot, it stays.
+     */
+    budget = hot_packets * (busy[hot] - busy[cold]) / (2 * busy[hot]);
+
+    memset(reta_conf, 0, sizeof(reta_conf));
+    while (moved < FF_RETA_MAX_MOVES) {
+        best = -1;
+        for (b = 0; b < reta_size; b++) {
+            if (reta->queue[b] != hot ||
+                reta->prev[b] != FF_RETA_NO_HANDOFF ||
+                delta[b] == 0 || delta[b] > budget) {
+                continue;
+            }
+            if (best < 0 || delta[b] > delta[best]) {
+                best = b;
+            }
+        }
+        if (best < 0) {
+            break;
+        }
+
+        budget -= delta[best];
+        reta->prev[best] = hot;
+        /* The new queue must see the handoff before the packets */
+        rte_smp_wmb();
+        reta->queue[best] = cold;
+
+        reta_conf[best / RTE_RETA_GROUP_SIZE].mask |=
+            1ULL << (best % RTE_RETA_GROUP_SIZE);
+        reta_conf[best / RTE_RETA_GROUP_SIZE].reta[best %
+            RTE_RETA_GROUP_SIZE] = cold;
+        moved++;
+    }
+
+    if (moved == 0) {
+        return;
+    }
+
+    if (rte_eth_dev_rss_reta_update(port_id, reta_conf, reta_size)) {
+        printf("port[%d]: failed to update rss table\n", port_id);
+        for (b = 0; b < reta_size; b++) {
+            if (reta_conf[b / RTE_RETA_GROUP_SIZE].mask &
+                (1ULL << (b % RTE_RETA_GROUP_SIZE))) {
+                reta->queue[b] = hot;
+                reta->prev[b] = FF_RETA_NO_HANDOFF;
+            }
+        }
+        return;
+    }
+
+    rte_smp_wmb();
+    reta->generation++;
+}
+
+/*
+ * Sample the busy ratio of every process from its stats memzone, and move
+ * RETA buckets of each port from its busiest queue to its idlest one.
+ */
+static void
+reta_rebalance(void)
+{
+    uint16_t nb_procs = ff_global_cfg.dpdk.nb_procs;
+    uint32_t busy[RTE_MAX_LCORE];
+    uint16_t i;
+
+    if (packet_dispatcher || packet_dispatcher_burst) {
+        return;
+    }
+
+    if (reta_samples == NULL) {
+        reta_samples = rte_zmalloc("reta_samples",
+            sizeof(struct reta_sample) * RTE_MAX_ETHPORTS, 0);
+        if (reta_samples == NULL) {
+            return;
+        }
+    }
+
+    for (i = 0; i < nb_procs; i++) {
+        struct ff_top_args *top;
+        uint64_t busy_tsc;
+
+        busy[i] = UINT32_MAX;
+
+        if (proc_stats[i] == NULL) {
+            char name[RTE_MEMZONE_NAMESIZE];
+            const struct rte_memzone *mz;
+
+            snprintf(name, sizeof(name), "%s%u", FF_STATS_MZ, i);
+            mz = rte_memzone_lookup(name);
+            if (mz == NULL) {
+                continue;
+            }
+            proc_stats[i] = mz->addr;
+        }
+
+        top = &proc_stats[i]->top;
+        busy_tsc = top->sys_tsc + top->usr_tsc;
+        /* Unknown for the first round and after a restart */
+        if (proc_work_tsc[i] != 0 && top->work_tsc > proc_work_tsc[i] &&
+            busy_tsc >= proc_busy_tsc[i]) {
+            busy[i] = (busy_tsc - proc_busy_tsc[i]) * 100 /
+                (top->work_tsc - proc_work_tsc[i]);
+        }
+        proc_busy_tsc[i] = busy_tsc;
+        proc_work_tsc[i] = top->work_tsc;
+    }
+
+    for (i = 0; i < ff_global_cfg.dpdk.nb_ports; i++) {
+        uint16_t port_id = ff_global_cfg.dpdk.portid_list[i];
+
+        if (reta_tables[port_id].enabled) {
+            reta_rebalance_port(port_id, busy);
+        }
+    }
 }
 
 static int
@@ -2058,27 +3431,69 @@ main_loop(void *arg)
 
     struct rte_mbuf *pkts_burst[MAX_PKT_BURST];
     uint64_t prev_tsc, diff_tsc, cur_tsc, usch_tsc, div_tsc, usr_tsc, sys_tsc, end_tsc, idle_sleep_tsc;
-    int i, j, nb_rx, idle;
+    int i, nb_rx, idle;
     uint16_t port_id, queue_id;
     struct lcore_conf *qconf;
     uint64_t drain_tsc = 0;
+    unsigned cur_sleep = 0, sleep_us;
     struct ff_dpdk_if_context *ctx;
+#ifdef FF_TCPHPTS
+    uint64_t hpts_tsc = 0, hpts_deadline = 0;
+    int hpts_pending = 0;
+#endif
+    uint64_t reta_tsc = 0, reta_deadline = 0;
 
     if (pkt_tx_delay) {
         drain_tsc = (rte_get_tsc_hz() + US_PER_S - 1) / US_PER_S * pkt_tx_delay;
     }
 
+#ifdef FF_TCPHPTS
+    if (ff_global_cfg.freebsd.hpts_us > 0) {
+        hpts_tsc = (rte_get_tsc_hz() + US_PER_S - 1) / US_PER_S *
+            ff_global_cfg.freebsd.hpts_us;
+    }
+#endif
+
+    if (reta_rebalance_ms) {
+        reta_tsc = (rte_get_tsc_hz() + MS_PER_S - 1) / MS_PER_S *
+            reta_rebalance_ms;
+        reta_deadline = rte_rdtsc() + reta_tsc;
+    }
+
     prev_tsc = 0;
     usch_tsc = 0;
 
     qconf = &lcore_conf;
 
+    if (rx_intr && rx_intr_init(qconf) != 0) {
+        rx_intr = 0;
+    }
+
     while (1) {
         cur_tsc = rte_rdtsc();
         if (unlikely(freebsd_clock.expire < cur_tsc)) {
             rte_timer_manage();
         }
 
+#ifdef FF_TCPHPTS
+        if (hpts_tsc && cur_tsc >= hpts_deadline) {
+            hpts_pending = ff_hpts_run();
+            hpts_deadline = cur_tsc + hpts_tsc;
+        }
+#endif
+
+        if (unlikely(reta_tsc && cur_tsc >= reta_deadline)) {
+            reta_owned_update();
+            if (rte_eal_process_type() == RTE_PROC_PRIMARY) {
+                reta_rebalance();
+            }
+            reta_deadline = cur_tsc + reta_tsc;
+        }
+
+        if (unlikely(reta_walks_active)) {
+            reta_owned_step();
+        }
+
         idle = 1;
         sys_tsc = 0;
         usr_tsc = 0;
@@ -2128,37 +3543,37 @@ main_loop(void *arg)
 
             idle = 0;
 
-            /* Prefetch first packets */
-            for (j = 0; j < PREFETCH_OFFSET && j < nb_rx; j++) {
-                rte_prefetch0(rte_pktmbuf_mtod(
-                        pkts_burst[j], void *));
-            }
-
-            /* Prefetch and handle already prefetched packets */
-            for (j = 0; j < (nb_rx - PREFETCH_OFFSET); j++) {
-                rte_prefetch0(rte_pktmbuf_mtod(pkts_burst[
-                        j + PREFETCH_OFFSET], void *));
-                process_packets(port_id, queue_id, &pkts_burst[j], 1, ctx, 0);
-            }
-
-            /* Handle remaining prefetched packets */
-            for (; j < nb_rx; j++) {
-                process_packets(port_id, queue_id, &pkts_burst[j], 1, ctx, 0);
-            }
+            process_packets(port_id, queue_id, pkts_burst, nb_rx, ctx, 0);
         }
 
         process_msg_ring(qconf->proc_id, pkts_burst);
 
+        if (ff_zc_completion_flush())
+            idle = 0;
+
+        tx_tso_flush(qconf);
+
         div_tsc = rte_rdtsc();
 
         if (likely(lr->loop != NULL && (!idle || cur_tsc - usch_tsc >= drain_tsc))) {
             usch_tsc = cur_tsc;
             lr->loop(lr->arg);
+            tx_tso_flush(qconf);
         }
 
         idle_sleep_tsc = rte_rdtsc();
-        if (likely(idle && idle_sleep)) {
-            usleep(idle_sleep);
+        cur_sleep = idle ? idle_sleep_next(cur_sleep) : 0;
+        sleep_us = cur_sleep;
+#ifdef FF_TCPHPTS
+        /* Paced connections are due at the next hpts run, wake up for it */
+        if (sleep_us && hpts_pending) {
+            sleep_us = hpts_deadline > idle_sleep_tsc ?
+                RTE_MIN(sleep_us, (hpts_deadline - idle_sleep_tsc) *
+                US_PER_S / rte_get_tsc_hz()) : 0;
+        }
+#endif
+        if (likely(sleep_us)) {
+            idle_wait(qconf, sleep_us);
             end_tsc = rte_rdtsc();
         } else {
             end_tsc = idle_sleep_tsc;
@@ -2171,14 +3586,14 @@ main_loop(void *arg)
 
         if (!idle) {
             sys_tsc = div_tsc - cur_tsc - usr_cb_tsc;
-            ff_top_status.sys_tsc += sys_tsc;
+            ff_stats->top.sys_tsc += sys_tsc;
         }
 
-        ff_top_status.usr_tsc += usr_tsc;
-        ff_top_status.work_tsc += end_tsc - cur_tsc;
-        ff_top_status.idle_tsc += end_tsc - cur_tsc - usr_tsc - sys_tsc;
+        ff_stats->top.usr_tsc += usr_tsc;
+        ff_stats->top.work_tsc += end_tsc - cur_tsc;
+        ff_stats->top.idle_tsc += end_tsc - cur_tsc - usr_tsc - sys_tsc;
 
-        ff_top_status.loops++;
+        ff_stats->top.loops++;
     }
 
     return 0;
@@ -2218,29 +3633,6 @@ ff_dpdk_pktmbuf_free(void *m)
     rte_pktmbuf_free_seg((struct rte_mbuf *)m);
 }
 
-static uint32_t
-toeplitz_hash(unsigned keylen, const uint8_t *key,
-    unsigned datalen, const uint8_t *data)
-{
-    uint32_t hash = 0, v;
-    u_int i, b;
-
-    /* XXXRW: Perhaps an assertion about key length vs. data length? */
-
-    v = (key[0]<<24) + (key[1]<<16) + (key[2] <<8) + key[3];
-    for (i = 0; i < datalen; i++) {
-        for (b = 0; b < 8; b++) {
-            if (data[i] & (1<<(7-b)))
-                hash ^= v;
-            v <<= 1;
-            if ((i + 4) < keylen &&
-                (key[i+4] & (1<<(7-b))))
-                v |= 1;
-        }
-    }
-    return (hash);
-}
-
 int
 ff_in_pcbladdr(uint16_t family, void *faddr, uint16_t fport, void *laddr)
 {
@@ -2268,6 +3660,34 @@ ff_regist_pcblddr_fun(pcblddr_func_t func)
     pcblddr_fun = func;
 }
 
+static inline int
+rss_hash_to_local_queue(uint16_t port_id, uint32_t hash)
+{
+    struct lcore_conf *qconf = &lcore_conf;
+    uint16_t nb_queues = qconf->nb_queue_list[port_id];
+    uint16_t reta_size = rss_reta_size[port_id];
+    uint16_t queueid = qconf->tx_queue_id[port_id];
+    uint32_t bucket = hash & (reta_size - 1);
+
+    if (reta_tables != NULL && reta_tables[port_id].enabled) {
+        return reta_tables[port_id].queue[bucket] == queueid;
+    }
+
+    return (bucket % nb_queues) == queueid;
+}
+
+uint32_t
+ff_rss_generation(void *softc)
+{
+    struct ff_dpdk_if_context *ctx = ff_veth_softc_to_hostc(softc);
+
+    if (reta_tables == NULL) {
+        return 0;
+    }
+
+    return reta_tables[ctx->port_id].generation;
+}
+
 int
 ff_rss_check(void *softc, uint32_t saddr, uint32_t daddr,
     uint16_t sport, uint16_t dport)
@@ -2280,11 +3700,7 @@ ff_rss_check(void *softc, uint32_t saddr, uint32_t daddr,
         return 1;
     }
 
-    uint16_t reta_size = rss_reta_size[ctx->port_id];
-    uint16_t queueid = qconf->tx_queue_id[ctx->port_id];
-
-    uint8_t data[sizeof(saddr) + sizeof(daddr) + sizeof(sport) +
-        sizeof(dport)];
+    uint8_t data[RSS_TUPLE_LEN];
 
     unsigned datalen = 0;
 
@@ -2301,9 +3717,47 @@ ff_rss_check(void *softc, uint32_t saddr, uint32_t daddr,
     datalen += sizeof(dport);
 
     uint32_t hash = 0;
-    hash = toeplitz_hash(rsskey_len, rsskey, datalen, data);
+    hash = toeplitz_hash(data, datalen, 0);
 
-    return ((hash & (reta_size - 1)) % nb_queues) == queueid;
+    return rss_hash_to_local_queue(ctx->port_id, hash);
+}
+
+int
+ff_rss_lports(void *softc, uint32_t saddr, uint32_t daddr, uint16_t sport,
+    uint16_t first, uint16_t last, uint16_t *lports, int max)
+{
+    struct lcore_conf *qconf = &lcore_conf;
+    struct ff_dpdk_if_context *ctx = ff_veth_softc_to_hostc(softc);
+    uint16_t nb_queues = qconf->nb_queue_list[ctx->port_id];
+    uint8_t data[RSS_TUPLE_LEN - sizeof(uint16_t)];
+    uint32_t prefix, hash;
+    unsigned datalen = 0;
+    int n = 0;
+    uint32_t port;
+
+    bcopy(&saddr, &data[datalen], sizeof(saddr));
+    datalen += sizeof(saddr);
+
+    bcopy(&daddr, &data[datalen], sizeof(daddr));
+    datalen += sizeof(daddr);
+
+    bcopy(&sport, &data[datalen], sizeof(sport));
+    datalen += sizeof(sport);
+
+    /* Hash of the prefix, only the last two bytes change from now on */
+    prefix = toeplitz_hash(data, datalen, 0);
+
+    for (port = first; port <= last && n < max; port++) {
+        if (nb_queues > 1) {
+            hash = prefix ^ rss_hash_table[datalen][port >> 8] ^
+                rss_hash_table[datalen + 1][port & 0xff];
+            if (!rss_hash_to_local_queue(ctx->port_id, hash))
+                continue;
+        }
+        lports[n++] = rte_cpu_to_be_16(port);
+    }
+
+    return n;
 }
 
 void
@@ -2312,6 +3766,12 @@ ff_regist_packet_dispatcher(dispatch_func_t func)
     packet_dispatcher = func;
 }
 
+void
+ff_regist_packet_dispatcher_burst(dispatch_burst_func_t func)
+{
+    packet_dispatcher_burst = func;
+}
+
 uint64_t
 ff_get_tsc_ns()
 {
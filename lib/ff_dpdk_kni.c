@@ -569,3 +569,14 @@ ff_kni_enqueue(uint16_t port_id, struct rte_mbuf *pkt)
     return 0;
 }
 
+int
+ff_kni_enqueue_burst(uint16_t port_id, struct rte_mbuf **pkts, uint16_t count)
+{
+    uint16_t ret = rte_ring_enqueue_burst(kni_rp[port_id], (void **)pkts,
+        count, NULL);
+    for (; ret < count; ret++)
+        rte_pktmbuf_free(pkts[ret]);
+
+    return 0;
+}
+
@@ -55,5 +55,8 @@ enum FilterReturn ff_kni_proto_filter(const void *data, uint16_t len, uint16_t e
 
 int ff_kni_enqueue(uint16_t port_id, struct rte_mbuf *pkt);
 
+int ff_kni_enqueue_burst(uint16_t port_id, struct rte_mbuf **pkts,
+    uint16_t count);
+
 
 #endif /* ifndef _FSTACK_DPDK_KNI_H */
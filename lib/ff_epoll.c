@@ -115,6 +115,8 @@ ff_event_to_epoll(void **ev, struct kevent *kev)
         }
     } else if (kev->filter == EVFILT_WRITE) {
         event_one |= EPOLLOUT;
+    } else if (kev->filter == EVFILT_USER) {
+        event_one |= EPOLLIN;
     }
 
     if (kev->flags & EV_ERROR) {
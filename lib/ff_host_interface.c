@@ -41,18 +41,36 @@
 
 #include <openssl/rand.h>
 #include <rte_malloc.h>
+#include <rte_memory.h>
+#include <rte_lcore.h>
 
 #include "ff_host_interface.h"
+#include "ff_config.h"
 #include "ff_errno.h"
 
 static struct timespec current_ts;
 extern void* ff_mem_get_page();
 extern int ff_mem_free_addr(void* p);
 
+/*
+ * With freebsd.boot hugepage_mem, the kernel's page allocations (the UMA
+ * slabs) come from the hugepage heap of our own NUMA socket.  Falls back
+ * to mmap when that heap is exhausted.
+ */
+static inline void *
+ff_mmap_hugepage(uint64_t len, int flags, int fd)
+{
+    if (!ff_global_cfg.freebsd.hugepage_mem || fd != -1 ||
+        (flags & ff_MAP_ANON) == 0 || (flags & ff_MAP_SHARED)) {
+        return NULL;
+    }
+
+    return rte_zmalloc_socket("ff_kmem", len, 4096, rte_socket_id());
+}
+
 void *
 ff_mmap(void *addr, uint64_t len, int prot, int flags, int fd, uint64_t offset)
 {
-    //return rte_malloc("", len, 4096);
     int host_prot;
     int host_flags;
 
@@ -64,6 +82,13 @@ ff_mmap(void *addr, uint64_t len, int prot, int flags, int fd, uint64_t offset)
 #endif
         {
 
+    if (addr == NULL) {
+        void *ret = ff_mmap_hugepage(len, flags, fd);
+        if (ret != NULL) {
+            return ret;
+        }
+    }
+
     assert(ff_PROT_NONE == PROT_NONE);
     host_prot = 0;
     if ((prot & ff_PROT_READ) == ff_PROT_READ)   host_prot |= PROT_READ;
@@ -92,8 +117,12 @@ ff_munmap(void *addr, uint64_t len)
             return ff_mem_free_addr(addr);
         }
 #endif
-    //rte_free(addr);
-    //return 0;
+    if (ff_global_cfg.freebsd.hugepage_mem &&
+        rte_mem_virt2memseg_list(addr) != NULL) {
+        rte_free(addr);
+        return 0;
+    }
+
     return (munmap(addr, len));
 }
 
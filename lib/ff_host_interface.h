@@ -78,5 +78,21 @@ int ff_in_pcbladdr(uint16_t family, void *faddr, uint16_t fport, void *laddr);
 int ff_rss_check(void *softc, uint32_t saddr, uint32_t daddr,
     uint16_t sport, uint16_t dport);
 
+/*
+ * Get the local ports in [first, last] (host byte order) for which the
+ * packets of (saddr, daddr, sport, lport) land on our queue, as checked by
+ * ff_rss_check, the addresses and sport are in network byte order like there.
+ * At most max ports are stored in lports, in network byte order.
+ * Return the number of ports stored.
+ */
+int ff_rss_lports(void *softc, uint32_t saddr, uint32_t daddr, uint16_t sport,
+    uint16_t first, uint16_t last, uint16_t *lports, int max);
+
+/*
+ * Bumped whenever the RSS RETA of the port is rewritten, results of
+ * ff_rss_check and ff_rss_lports from an older generation are stale.
+ */
+uint32_t ff_rss_generation(void *softc);
+
 #endif
 
@@ -114,10 +114,28 @@ SYSCTL_INT(_kern, OID_AUTO, pin_pcpu_swi, CTLFLAG_RDTUN | CTLFLAG_NOFETCH, &pin_
 #define    CC_HASH_SHIFT    8
 
 /*
- * TODO:
- *    allocate more timeout table slots when table overflows.
+ * Hierarchical timing wheel.
+ * Level 0 has one slot per tick, every upper level has CC_WHEELN_SIZE slots
+ * each covering a whole revolution of the level below.  A callout is hashed
+ * into the lowest level its distance fits in and moved down a level only
+ * when the lower one wraps (lazy cascade), so arming, resetting and stopping
+ * are O(1) and softclock never walks callouts that are not due yet.
+ * Five levels cover the whole int range of c_time.
  */
-u_int callwheelsize, callwheelmask;
+#define    CC_WHEEL0_BITS     8
+#define    CC_WHEELN_BITS     6
+#define    CC_WHEEL0_SIZE     (1 << CC_WHEEL0_BITS)
+#define    CC_WHEELN_SIZE     (1 << CC_WHEELN_BITS)
+#define    CC_WHEEL0_MASK     (CC_WHEEL0_SIZE - 1)
+#define    CC_WHEELN_MASK     (CC_WHEELN_SIZE - 1)
+#define    CC_WHEEL_LEVELS    5
+#define    CC_WHEEL_SIZE      (CC_WHEEL0_SIZE + \
+                               (CC_WHEEL_LEVELS - 1) * CC_WHEELN_SIZE)
+
+/* Shift of the c_time bits indexing level 'l' (l >= 1). */
+#define    CC_WHEEL_SHIFT(l)  (CC_WHEEL0_BITS + ((l) - 1) * CC_WHEELN_BITS)
+#define    CC_WHEEL_SLOT(l, i) \
+    (CC_WHEEL0_SIZE + ((l) - 1) * CC_WHEELN_SIZE + (i))
 
 /*
  * The callout cpu exec entities represent informations necessary for
@@ -145,14 +163,13 @@ struct callout_cpu {
     struct cc_exec cc_exec_entity[2];
     struct callout *cc_next;
     struct callout *cc_callout;
-    struct callout_list *cc_callwheel;
     struct callout_tailq cc_expireq;
     struct callout_slist cc_callfree;
     int cc_softticks;
     void *cc_cookie;
-    u_int cc_bucket;
     u_int cc_inited;
     char cc_ktr_event_name[20];
+    struct callout_list cc_callwheel[CC_WHEEL_SIZE] __aligned(CACHE_LINE_SIZE);
 };
 
 #define callout_migrating(c)    ((c)->c_iflags & CALLOUT_DFRMIGRATION)
@@ -236,13 +253,6 @@ callout_callwheel_init(void *dummy)
     ncallout = imin(16 + maxproc + maxfiles, 18508);
     TUNABLE_INT_FETCH("kern.ncallout", &ncallout);
 
-    /*
-     * Calculate callout wheel size, should be next power of two higher
-     * than 'ncallout'.
-     */
-    callwheelsize = 1 << fls(ncallout);
-    callwheelmask = callwheelsize - 1;
-
     /*
      * Fetch whether we're pinning the swi's or not.
      */
@@ -275,9 +285,7 @@ callout_cpu_init(struct callout_cpu *cc, int cpu)
     mtx_init(&cc->cc_lock, "callout", NULL, MTX_SPIN | MTX_RECURSE);
     SLIST_INIT(&cc->cc_callfree);
     cc->cc_inited = 1;
-    cc->cc_callwheel = malloc(sizeof(struct callout_list) * callwheelsize,
-        M_CALLOUT, M_WAITOK);
-    for (i = 0; i < callwheelsize; i++)
+    for (i = 0; i < CC_WHEEL_SIZE; i++)
         LIST_INIT(&cc->cc_callwheel[i]);
     TAILQ_INIT(&cc->cc_expireq);
     for (i = 0; i < 2; i++)
@@ -294,39 +302,67 @@ callout_cpu_init(struct callout_cpu *cc, int cpu)
     }
 }
 
+/*
+ * Pick the wheel slot of a callout expiring at c_time, relative to
+ * cc_softticks, the next tick softclock will process.
+ */
 static inline u_int
-callout_get_bucket(int to_ticks)
+callout_get_bucket(struct callout_cpu *cc, int c_time)
+{
+    u_int delta;
+    int level;
+
+    delta = (u_int)(c_time - cc->cc_softticks);
+    if ((int)delta < 0)
+        return (cc->cc_softticks & CC_WHEEL0_MASK);
+    if (delta < CC_WHEEL0_SIZE)
+        return (c_time & CC_WHEEL0_MASK);
+
+    for (level = 1; level < CC_WHEEL_LEVELS - 1; level++) {
+        if (delta < (1u << CC_WHEEL_SHIFT(level + 1)))
+            break;
+    }
+
+    return (CC_WHEEL_SLOT(level,
+        ((u_int)c_time >> CC_WHEEL_SHIFT(level)) & CC_WHEELN_MASK));
+}
+
+/*
+ * Level 0 wrapped at curticks: rehash the due slot of level 1 and, as long
+ * as they wrap too, of the levels above.
+ */
+static void
+callout_cascade(struct callout_cpu *cc, int curticks)
 {
-    return (to_ticks & callwheelmask);
+    struct callout_list *sc;
+    struct callout *c;
+    int level, idx;
+
+    for (level = 1; level < CC_WHEEL_LEVELS; level++) {
+        idx = ((u_int)curticks >> CC_WHEEL_SHIFT(level)) & CC_WHEELN_MASK;
+        sc = &cc->cc_callwheel[CC_WHEEL_SLOT(level, idx)];
+        while ((c = LIST_FIRST(sc)) != NULL) {
+            LIST_REMOVE(c, c_links.le);
+            LIST_INSERT_HEAD(
+                &cc->cc_callwheel[callout_get_bucket(cc, c->c_time)],
+                c, c_links.le);
+        }
+        if (idx != 0)
+            break;
+    }
 }
 
 void
 callout_tick(void)
 {
     struct callout_cpu *cc;
-    int need_softclock;
-    int bucket;
 
     /*
-     * Process callouts at a very low cpu priority, so we don't keep the
-     * relatively high clock interrupt priority any longer than necessary.
+     * Every tick is a single slot of level 0 and an occasional cascade,
+     * so there is nothing worth prescanning here.
      */
-    need_softclock = 0;
     cc = CC_SELF();
-    mtx_lock(&cc->cc_lock);
-    for (; (cc->cc_softticks - ticks) < 0; cc->cc_softticks++) {
-        bucket = cc->cc_softticks & callwheelmask;
-        if (!LIST_EMPTY(&cc->cc_callwheel[bucket])) {
-            need_softclock = 1;
-            break;
-        }
-    }
-    mtx_unlock(&cc->cc_lock);
-    /*
-     * swi_sched acquires the thread lock, so we don't want to call it
-     * with cc_lock held; incorrect locking order.
-     */
-    if (need_softclock)
+    if (cc->cc_softticks != ticks)
         softclock(cc);
 }
 
@@ -363,10 +399,8 @@ callout_cc_add(struct callout *c, struct callout_cpu *cc,
         c->c_iflags |= CALLOUT_DIRECT;
     c->c_func = func;
     c->c_time = ticks + to_ticks;
-    bucket = callout_get_bucket(c->c_time);
+    bucket = callout_get_bucket(cc, c->c_time);
     LIST_INSERT_HEAD(&cc->cc_callwheel[bucket], c, c_links.le);
-    if (cc->cc_bucket == bucket)
-        cc_exec_next(cc) = c;
 }
 
 static void
@@ -559,8 +593,8 @@ softclock(void *arg)
 {
     struct callout *c;
     struct callout_cpu *cc;
-    struct callout_list *sc;
-    int curticks;
+    struct callout_list expired;
+    int curticks, idx;
 #ifdef CALLOUT_PROFILING
     int depth = 0, gcalls = 0, mpcalls = 0, lockcalls = 0;
 #endif
@@ -568,34 +602,33 @@ softclock(void *arg)
     cc = (struct callout_cpu *)arg;
     CC_LOCK(cc);
 
+    LIST_INIT(&expired);
     while (cc->cc_softticks != ticks) {
-        /*
-         * cc_softticks may be modified by hard clock, so cache
-         * it while we work on a given bucket.
-         */
         curticks = cc->cc_softticks;
+        idx = curticks & CC_WHEEL0_MASK;
+        if (idx == 0)
+            callout_cascade(cc, curticks);
         cc->cc_softticks++;
-        sc = &cc->cc_callwheel[curticks & callwheelmask];
-        c = LIST_FIRST(sc);
+
+        /*
+         * Everything in a level 0 slot is due.  Detach the slot first,
+         * callouts rearmed from the handlers may hash into it again.
+         */
+        LIST_SWAP(&expired, &cc->cc_callwheel[idx], callout, c_links.le);
+        c = LIST_FIRST(&expired);
         while (c) {
 #ifdef CALLOUT_PROFILING
             depth++;
 #endif
-            if (c->c_time != curticks) {
-                c = LIST_NEXT(c, c_links.le);
-            } else {
-                cc_exec_next(cc) =
-                    LIST_NEXT(c, c_links.le);
-                cc->cc_bucket = callout_get_bucket(curticks);
-                LIST_REMOVE(c, c_links.le);
-                softclock_call_cc(c, cc,
+            cc_exec_next(cc) = LIST_NEXT(c, c_links.le);
+            LIST_REMOVE(c, c_links.le);
+            softclock_call_cc(c, cc,
 #ifdef CALLOUT_PROFILING
-                    &mpcalls, &lockcalls, &gcalls,
+                &mpcalls, &lockcalls, &gcalls,
 #endif
-                    1);
-                c = cc_exec_next(cc);
-                cc_exec_next(cc) = NULL;
-            }
+                1);
+            c = cc_exec_next(cc);
+            cc_exec_next(cc) = NULL;
         }
     }
 
@@ -1141,7 +1174,7 @@ sysctl_kern_callout_stat(SYSCTL_HANDLER_ARGS)
 
     cc = CC_CPU(timeout_cpu);
     CC_LOCK(cc);
-    for (i = 0; i < callwheelsize; i++) {
+    for (i = 0; i < CC_WHEEL_SIZE; i++) {
         sc = &cc->cc_callwheel[i];
         c = 0;
         LIST_FOREACH(tmp, sc, c_links.le) {
@@ -1170,11 +1203,11 @@ sysctl_kern_callout_stat(SYSCTL_HANDLER_ARGS)
 
     printf("Scheduled callouts statistic snapshot:\n");
     printf("  Callouts: %6d  Buckets: %6d*%-3d  Bucket size: 0.%06ds\n",
-        count, callwheelsize, mp_ncpus, 1000000 >> CC_HASH_SHIFT);
+        count, CC_WHEEL_SIZE, mp_ncpus, 1000000 >> CC_HASH_SHIFT);
     printf("  C/Bk: med %5d         avg %6d.%06jd  max %6d\n",
         medc,
-        count / callwheelsize / mp_ncpus,
-        (uint64_t)count * 1000000 / callwheelsize / mp_ncpus % 1000000,
+        count / CC_WHEEL_SIZE / mp_ncpus,
+        (uint64_t)count * 1000000 / CC_WHEEL_SIZE / mp_ncpus % 1000000,
         maxc);
     printf("  Time: med %5jd.%06jds avg %6d.%06ds max %ds\n",
         medt / SBT_1S, (medt & 0xffffffff) * 1000000 >> 32,
@@ -1213,22 +1246,93 @@ ff_hardclock(void)
 #endif /* DEVICE_POLLING */
 }
 
+#ifdef FF_CALLOUT_BENCH
+/*
+ * Reset/expiry benchmark of the callwheel, see example/main_timer_bench.c.
+ * The callouts are driven by ff_callout_bench_tick() instead of the F-Stack
+ * clock, so it must not run alongside ff_run().
+ */
+static struct callout *bench_callouts;
+static unsigned bench_ncallouts;
+static uint64_t bench_expired;
+
+int ff_callout_bench_init(unsigned n);
+void ff_callout_bench_reset(unsigned i, int to_ticks);
+uint64_t ff_callout_bench_tick(void);
+void ff_callout_bench_fini(void);
+
+static void
+ff_callout_bench_expire(void *arg)
+{
+    bench_expired++;
+}
+
+int
+ff_callout_bench_init(unsigned n)
+{
+    unsigned i;
+
+    bench_callouts = malloc(n * sizeof(struct callout), M_TEMP, M_NOWAIT);
+    if (bench_callouts == NULL)
+        return (ENOMEM);
+
+    for (i = 0; i < n; i++)
+        callout_init(&bench_callouts[i], 1);
+    bench_ncallouts = n;
+    bench_expired = 0;
+
+    return (0);
+}
+
+void
+ff_callout_bench_reset(unsigned i, int to_ticks)
+{
+    callout_reset(&bench_callouts[i], to_ticks, ff_callout_bench_expire,
+        NULL);
+}
+
+/* Advance the clock by one tick, return the callouts expired so far */
+uint64_t
+ff_callout_bench_tick(void)
+{
+    atomic_add_int(&ticks, 1);
+    callout_tick();
+
+    return (bench_expired);
+}
+
+void
+ff_callout_bench_fini(void)
+{
+    unsigned i;
+
+    for (i = 0; i < bench_ncallouts; i++)
+        callout_stop(&bench_callouts[i]);
+    free(bench_callouts, M_TEMP);
+    bench_callouts = NULL;
+    bench_ncallouts = 0;
+}
+#endif /* FF_CALLOUT_BENCH */
+
+/*
+ * Count microseconds rather than hz ticks, so that binuptime() and friends
+ * keep a usable resolution for the hpts pacer with a low hz.
+ */
+#define FF_TC_FREQUENCY 1000000
+
 static unsigned int
 ff_tc_get_timecount(struct timecounter *tc)
 {
-    uint64_t ns;
-    ns = ff_get_tsc_ns();
-    return ((ns * tc->tc_frequency) / ff_NSEC_PER_SEC);
+    return (ff_get_tsc_ns() / (ff_NSEC_PER_SEC / FF_TC_FREQUENCY));
 }
 
 static struct timecounter ff_timecounter = {
-    ff_tc_get_timecount, 0, ~0u, 100, "ff_clock", 1
+    ff_tc_get_timecount, 0, ~0u, FF_TC_FREQUENCY, "ff_clock", 1
 };
 
 static void
 ff_tc_init(void)
 {
-    ff_timecounter.tc_frequency = hz;
     tc_init(&ff_timecounter);
 }
 SYSINIT(ff_tc, SI_SUB_SMP, SI_ORDER_ANY, ff_tc_init, NULL);
@@ -105,6 +105,10 @@ void ff_init_ref_pool(int nb_mbuf, int socketid);
 int ff_mmap_init();
 int ff_if_send_onepkt(struct ff_dpdk_if_context *ctx, void *m, int total);
 int ff_enq_tx_bsdmbuf(uint8_t portid, void *p_mbuf, int nb_segs);
+
+struct ff_tx_offload;
+void ff_dpdk_tx_offload_set(struct rte_mbuf *head,
+    struct ff_tx_offload *offload, uint8_t tx_csum_l4);
 #endif
 
 #ifdef __cplusplus
@@ -32,6 +32,13 @@
 #define FF_MSG_RING_IN  "ff_msg_ring_in_"
 #define FF_MSG_RING_OUT "ff_msg_ring_out_"
 #define FF_MSG_POOL     "ff_msg_pool"
+#define FF_STATS_MZ     "ff_stats_"
+
+/* Destination queues with their own dispatch drop counter */
+#define FF_MAX_DISPATCH_QUEUES 128
+
+/* Largest RSS RETA that dpdk.reta_rebalance_ms can rewrite */
+#define FF_RETA_SIZE_MAX 512
 
 /* MSG TYPE: sysctl, ioctl, etc.. */
 enum FF_MSG_TYPE {
@@ -45,6 +52,7 @@ enum FF_MSG_TYPE {
     FF_IPFW_CTL,
     FF_TRAFFIC,
     FF_KNICTL,
+    FF_FLOW,
 
     /*
      * to add other msg type before FF_MSG_NUM
@@ -107,6 +115,44 @@ struct ff_traffic_args {
     uint64_t tx_bytes;
 };
 
+/* Counters of the queue that a F-Stack process owns on a port */
+struct ff_port_stats {
+    uint16_t enabled;
+    uint16_t queue_id;
+
+    uint64_t rx_packets;
+    uint64_t rx_bytes;
+    uint64_t tx_packets;
+    uint64_t tx_bytes;
+
+    /* dropped for bad checksum or no free mbuf header */
+    uint64_t rx_dropped;
+    /* not accepted by rte_eth_tx_burst */
+    uint64_t tx_dropped;
+    /* dropped for the dispatch ring of another queue is full */
+    uint64_t dispatch_dropped;
+    /* dispatch_dropped by destination queue */
+    uint64_t dispatch_dropped_to[FF_MAX_DISPATCH_QUEUES];
+    /* pktmbuf pool exhausted when sending */
+    uint64_t tx_nombuf;
+    /* received by RSS RETA bucket, only with dpdk.reta_rebalance_ms */
+    uint32_t reta_packets[FF_RETA_SIZE_MAX];
+    /* handed back to the previous queue of a moved bucket */
+    uint32_t reta_handoff[FF_RETA_SIZE_MAX];
+    /* TCP connections left in the buckets moved away from this queue */
+    uint32_t reta_owned[FF_RETA_SIZE_MAX];
+} __rte_cache_aligned;
+
+/*
+ * Stats of a F-Stack process, in the memzone FF_STATS_MZ<proc_id>.
+ * Only written by the process itself, tools read it directly without locks.
+ */
+struct ff_stats {
+    struct ff_top_args top;
+    struct ff_traffic_args traffic;
+    struct ff_port_stats port[RTE_MAX_ETHPORTS];
+} __rte_cache_aligned;
+
 enum FF_KNICTL_CMD {
     FF_KNICTL_CMD_GET,
     FF_KNICTL_CMD_SET,
@@ -125,6 +171,22 @@ struct ff_knictl_args {
     int kni_action;
 };
 
+enum FF_FLOW_CMD {
+    FF_FLOW_CMD_ADD,
+    FF_FLOW_CMD_DEL,
+    FF_FLOW_CMD_UNKNOWN,
+};
+
+/* Queue rule of a port, see flow_rules in config.ini */
+struct ff_flow_args {
+    int cmd;
+    uint16_t port_id;
+    uint8_t proto;
+    uint16_t sport;
+    uint16_t dport;
+    uint16_t queue;
+};
+
 
 #define MAX_MSG_BUF_SIZE 10240
 
@@ -149,6 +211,7 @@ struct ff_msg {
         struct ff_ipfw_args ipfw;
         struct ff_traffic_args traffic;
         struct ff_knictl_args knictl;
+        struct ff_flow_args flow;
     };
 } __attribute__((packed)) __rte_cache_aligned;
 
@@ -34,7 +34,11 @@
 #include <sys/module.h>
 #include <sys/param.h>
 #include <sys/malloc.h>
+#include <sys/lock.h>
+#include <sys/mutex.h>
+#include <sys/mbuf.h>
 #include <sys/socketvar.h>
+#include <sys/protosw.h>
 #include <sys/event.h>
 #include <sys/kernel.h>
 #include <sys/refcount.h>
@@ -937,6 +941,143 @@ kern_fail:
     return (-1);
 }
 
+/*
+ * Dequeue up to len bytes from the socket buffer and lend the mbuf chain
+ * to the caller instead of copying it out, see ff_zc_mbuf_read().
+ */
+ssize_t
+ff_zc_recv(int s, struct ff_zc_mbuf *zm, size_t len, int flags)
+{
+    struct uio auio;
+    struct file *fp;
+    struct socket *so;
+    struct mbuf *m = NULL;
+    int rc;
+
+    if (zm == NULL || len > INT_MAX) {
+        rc = EINVAL;
+        goto kern_fail;
+    }
+
+    if ((rc = getsock_cap(curthread, s, &cap_recv_rights, &fp, NULL, NULL)))
+        goto kern_fail;
+    so = fp->f_data;
+
+    auio.uio_iov = NULL;
+    auio.uio_iovcnt = 0;
+    auio.uio_offset = 0;
+    auio.uio_resid = len;
+    auio.uio_segflg = UIO_SYSSPACE;
+    auio.uio_rw = UIO_READ;
+    auio.uio_td = curthread;
+
+    rc = soreceive(so, NULL, &auio, &m, NULL, &flags);
+    fdrop(fp, curthread);
+    if (rc != 0 && (auio.uio_resid == (ssize_t)len ||
+        (rc != ERESTART && rc != EINTR && rc != EWOULDBLOCK))) {
+        if (m != NULL)
+            m_freem(m);
+        goto kern_fail;
+    }
+
+    zm->bsd_mbuf = zm->bsd_mbuf_off = m;
+    zm->off = 0;
+    zm->len = len - auio.uio_resid;
+
+    return (zm->len);
+kern_fail:
+    ff_os_errno(rc);
+    return (-1);
+}
+
+/* Cut the chain after len bytes, len > 0 */
+static void
+ff_zc_trim(struct mbuf *m, int len)
+{
+    while (m->m_len < len) {
+        len -= m->m_len;
+        m = m->m_next;
+    }
+
+    m->m_len = len;
+    m_freem(m->m_next);
+    m->m_next = NULL;
+}
+
+/*
+ * Send the mbuf chain of zm as is, see ff_zc_mbuf_attach().
+ * The chain is always consumed, even if sosend() fails.
+ */
+ssize_t
+ff_zc_send(int s, struct ff_zc_mbuf *zm, int flags)
+{
+    struct file *fp;
+    struct socket *so;
+    struct mbuf *top, *m;
+    long space;
+    int rc, len;
+
+    if (zm == NULL || zm->bsd_mbuf == NULL) {
+        rc = EINVAL;
+        goto kern_fail;
+    }
+
+    top = zm->bsd_mbuf;
+    zm->bsd_mbuf = zm->bsd_mbuf_off = NULL;
+    zm->off = zm->len = 0;
+
+    /* sosend() takes the length of the chain from the packet header */
+    len = m_length(top, NULL);
+    if ((top->m_flags & M_PKTHDR) == 0) {
+        m = m_gethdr(M_NOWAIT, MT_DATA);
+        if (m == NULL) {
+            m_freem(top);
+            rc = ENOBUFS;
+            goto kern_fail;
+        }
+        m->m_next = top;
+        top = m;
+    }
+    top->m_pkthdr.len = len;
+
+    if ((rc = getsock_cap(curthread, s, &cap_send_rights, &fp, NULL, NULL))) {
+        m_freem(top);
+        goto kern_fail;
+    }
+    so = fp->f_data;
+
+    /*
+     * sosend() sends a chain passed as top atomically, so clamp a stream
+     * to the free space and send the rest later, like ff_write does. If
+     * there is none, let sosend() wait or fail with EAGAIN as usual.
+     * Datagrams are sent whole or fail with EMSGSIZE.
+     */
+    space = 0;
+    if ((so->so_proto->pr_flags & PR_ATOMIC) == 0) {
+        SOCKBUF_LOCK(&so->so_snd);
+        space = sbspace(&so->so_snd);
+        if (space <= 0) {
+            space = so->so_snd.sb_hiwat;
+        }
+        SOCKBUF_UNLOCK(&so->so_snd);
+    }
+    if (space > 0 && len > space) {
+        len = space;
+        ff_zc_trim(top, len);
+        top->m_pkthdr.len = len;
+    }
+
+    rc = sosend(so, NULL, NULL, top, NULL, flags, curthread);
+    fdrop(fp, curthread);
+    if (rc)
+        goto kern_fail;
+
+    return (len);
+kern_fail:
+    ff_os_errno(rc);
+    return (-1);
+}
+
 int
 ff_fcntl(int fd, int cmd, ...)
 {
@@ -40,6 +40,9 @@
 #include <sys/sched.h>
 #include <sys/sockio.h>
 #include <sys/ck.h>
+#include <sys/event.h>
+#include <sys/malloc.h>
+#include <sys/sysctl.h>
 
 #include <net/if.h>
 #include <net/if_var.h>
@@ -53,6 +56,11 @@
 
 #include <netinet/in.h>
 #include <netinet/in_var.h>
+#include <netinet/in_pcb.h>
+#include <netinet/tcp_var.h>
+#include <netinet/tcp_syncache.h>
+#include <netinet/tcp_lro.h>
+#include <netinet6/in6_pcb.h>
 #include <netinet6/nd6.h>
 
 #include <machine/atomic.h>
@@ -84,6 +92,9 @@ struct ff_veth_softc {
     struct in6_addr vip6[VIP_MAX_NUM];
 #endif /* INET6 */
 
+    uint8_t lro_enabled;
+    struct lro_ctrl lro;
+
     struct ff_dpdk_if_context *host_ctx;
 };
 
@@ -212,15 +223,15 @@ ff_mbuf_tx_offload(void *m, struct ff_tx_offload *offload)
         offload->ip_csum = 1;
     }
 
-    if (mb->m_pkthdr.csum_flags & CSUM_TCP) {
+    if (mb->m_pkthdr.csum_flags & (CSUM_TCP | CSUM_IP6_TCP)) {
         offload->tcp_csum = 1;
     }
 
-    if (mb->m_pkthdr.csum_flags & CSUM_UDP) {
+    if (mb->m_pkthdr.csum_flags & (CSUM_UDP | CSUM_IP6_UDP)) {
         offload->udp_csum = 1;
     }
 
-    if (mb->m_pkthdr.csum_flags & CSUM_SCTP) {
+    if (mb->m_pkthdr.csum_flags & (CSUM_SCTP | CSUM_IP6_SCTP)) {
         offload->sctp_csum = 1;
     }
 
@@ -315,12 +326,199 @@ ff_zc_mbuf_write(struct ff_zc_mbuf *zm, const char *data, int len)
 }
 
 int
-ff_zc_mbuf_read(struct ff_zc_mbuf *m, const char *data, int len)
+ff_zc_mbuf_read(struct ff_zc_mbuf *zm, const char **data)
+{
+    struct mbuf *mb;
+
+    if (zm == NULL || data == NULL) {
+        return -1;
+    }
+
+    /* Skip empty mbufs, soreceive may hand over zero length ones */
+    for (mb = (struct mbuf *)zm->bsd_mbuf_off;
+        mb != NULL && mb->m_len == 0; mb = mb->m_next)
+        ;
+
+    if (mb == NULL || zm->off >= zm->len) {
+        zm->bsd_mbuf_off = NULL;
+        *data = NULL;
+        return 0;
+    }
+
+    *data = mtod(mb, const char *);
+    zm->off += mb->m_len;
+    zm->bsd_mbuf_off = mb->m_next;
+
+    return mb->m_len;
+}
+
+void
+ff_zc_mbuf_free(struct ff_zc_mbuf *zm)
+{
+    if (zm == NULL) {
+        return;
+    }
+
+    if (zm->bsd_mbuf != NULL) {
+        m_freem((struct mbuf *)zm->bsd_mbuf);
+    }
+
+    zm->bsd_mbuf = zm->bsd_mbuf_off = NULL;
+    zm->off = zm->len = 0;
+}
+
+/*
+ * Zero copy TX completions.
+ * A user buffer attached by ff_zc_mbuf_attach() is referenced by the socket
+ * buffer until it is acked, its ext_free queues the cookie here, and
+ * ff_zc_completion_flush() fires the registered EVFILT_USER event once per
+ * loop so the APP gets batched notifications.
+ */
+struct ff_zc_completion {
+    STAILQ_ENTRY(ff_zc_completion) next;
+    uint64_t cookie;
+};
+
+static STAILQ_HEAD(, ff_zc_completion) ff_zc_completions_done =
+    STAILQ_HEAD_INITIALIZER(ff_zc_completions_done);
+static int ff_zc_notify_kq = -1;
+static uintptr_t ff_zc_notify_ident;
+static int ff_zc_notify_pending;
+
+static void
+ff_zc_mbuf_ext_free(struct mbuf *m)
+{
+    struct ff_zc_completion *c = m->m_ext.ext_arg1;
+
+    STAILQ_INSERT_TAIL(&ff_zc_completions_done, c, next);
+    ff_zc_notify_pending = 1;
+}
+
+int
+ff_zc_mbuf_attach(struct ff_zc_mbuf *zm, void *buf, int len, uint64_t cookie)
+{
+    struct ff_zc_completion *c;
+    struct mbuf *mb;
+
+    if (zm == NULL || buf == NULL || len <= 0) {
+        return -1;
+    }
+
+    c = malloc(sizeof(struct ff_zc_completion), M_DEVBUF, M_NOWAIT);
+    if (c == NULL) {
+        return -1;
+    }
+    c->cookie = cookie;
+
+    mb = m_get(M_NOWAIT, MT_DATA);
+    if (mb == NULL) {
+        free(c, M_DEVBUF);
+        return -1;
+    }
+
+    m_extadd(mb, buf, len, ff_zc_mbuf_ext_free, c, NULL, M_RDONLY,
+        EXT_DISPOSABLE);
+    mb->m_len = len;
+
+    zm->bsd_mbuf = zm->bsd_mbuf_off = mb;
+    zm->off = len;
+    zm->len = len;
+
+    return 0;
+}
+
+/* If the data of mbuf is a buffer attached by ff_zc_mbuf_attach() */
+int
+ff_zc_mbuf_attached(void *mbuf)
+{
+    struct mbuf *m = mbuf;
+
+    return (m->m_flags & M_EXT) && m->m_ext.ext_type == EXT_DISPOSABLE &&
+        m->m_ext.ext_free == ff_zc_mbuf_ext_free;
+}
+
+/*
+ * Another reference on the buffer of an attached mbuf, for TX to send the
+ * buffer by reference, the buffer is not completed until it is dropped.
+ */
+void *
+ff_zc_mbuf_tx_ref(void *mbuf)
+{
+    struct mbuf *m = mbuf;
+
+    if (!ff_zc_mbuf_attached(m) || m->m_len <= 0) {
+        return NULL;
+    }
+
+    return m_copym(m, 0, m->m_len, M_NOWAIT);
+}
+
+void
+ff_zc_mbuf_tx_unref(void *ref)
+{
+    m_freem(ref);
+}
+
+int
+ff_zc_notify(int kq, uintptr_t ident)
 {
-    // DOTO: Support read zero copy
+    struct kevent kev;
+
+    if (kq < 0) {
+        ff_zc_notify_kq = -1;
+        return 0;
+    }
+
+    EV_SET(&kev, ident, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, NULL);
+    if (ff_kevent(kq, &kev, 1, NULL, 0, NULL) < 0) {
+        return -1;
+    }
+
+    ff_zc_notify_kq = kq;
+    ff_zc_notify_ident = ident;
+
     return 0;
 }
 
+int
+ff_zc_completions(uint64_t *cookies, int n)
+{
+    struct ff_zc_completion *c;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        c = STAILQ_FIRST(&ff_zc_completions_done);
+        if (c == NULL) {
+            break;
+        }
+        STAILQ_REMOVE_HEAD(&ff_zc_completions_done, next);
+        cookies[i] = c->cookie;
+        free(c, M_DEVBUF);
+    }
+
+    return i;
+}
+
+int
+ff_zc_completion_flush(void)
+{
+    struct kevent kev;
+
+    if (__predict_true(!ff_zc_notify_pending)) {
+        return 0;
+    }
+    ff_zc_notify_pending = 0;
+
+    if (ff_zc_notify_kq < 0) {
+        return 0;
+    }
+
+    EV_SET(&kev, ff_zc_notify_ident, EVFILT_USER, 0, NOTE_TRIGGER, 0, NULL);
+    ff_kevent(ff_zc_notify_kq, &kev, 1, NULL, 0, NULL);
+
+    return 1;
+}
+
 void *
 ff_mbuf_gethdr(void *pkt, uint16_t total, void *data,
     uint16_t len, uint8_t rx_csum)
@@ -349,6 +547,79 @@ ff_mbuf_gethdr(void *pkt, uint16_t total, void *data,
     return (void *)m;
 }
 
+/*
+ * Cache of pre-initialized mbuf headers used to wrap received rte_mbufs.
+ * Every F-Stack process runs the stack on a single lcore, so the cache is
+ * per-lcore and needs no locking. It is refilled from UMA in bulk, which
+ * keeps the allocator out of the per-packet RX path.
+ */
+#define FF_MBUF_HDR_CACHE_SIZE (MAX_PKT_BURST * 4)
+
+static struct mbuf *ff_mbuf_hdr_cache[FF_MBUF_HDR_CACHE_SIZE];
+static int ff_mbuf_hdr_cache_len;
+
+static inline void
+ff_mbuf_hdr_cache_fill(int want)
+{
+    struct mbuf *m;
+
+    if (want > FF_MBUF_HDR_CACHE_SIZE)
+        want = FF_MBUF_HDR_CACHE_SIZE;
+
+    /* Top up to the full size so the next few bursts are served from it */
+    if (ff_mbuf_hdr_cache_len >= want)
+        return;
+
+    while (ff_mbuf_hdr_cache_len < FF_MBUF_HDR_CACHE_SIZE) {
+        m = m_gethdr(M_NOWAIT, MT_DATA);
+        if (m == NULL)
+            break;
+        ff_mbuf_hdr_cache[ff_mbuf_hdr_cache_len++] = m;
+    }
+}
+
+/*
+ * Wrap a burst of received rte_mbufs into mbuf headers.
+ * hdrs[i] is set to NULL if no header could be allocated for pkts[i],
+ * the caller still owns the rte_mbuf in that case.
+ */
+int
+ff_mbuf_gethdr_burst(void **pkts, void **data, uint16_t *len,
+    uint16_t *total, int count, uint8_t rx_csum, void **hdrs)
+{
+    struct mbuf *m;
+    int i, nb_hdrs = 0;
+
+    ff_mbuf_hdr_cache_fill(count);
+
+    for (i = 0; i < count; i++) {
+        if (ff_mbuf_hdr_cache_len == 0) {
+            hdrs[i] = NULL;
+            continue;
+        }
+
+        /* m_gethdr has already initialized the packet header. */
+        m = ff_mbuf_hdr_cache[--ff_mbuf_hdr_cache_len];
+
+        m_extadd(m, data[i], len[i], ff_mbuf_ext_free, pkts[i], NULL, 0,
+            EXT_DISPOSABLE);
+
+        m->m_pkthdr.len = total[i];
+        m->m_len = len[i];
+
+        if (rx_csum) {
+            m->m_pkthdr.csum_flags = CSUM_IP_CHECKED | CSUM_IP_VALID |
+                CSUM_DATA_VALID | CSUM_PSEUDO_HDR;
+            m->m_pkthdr.csum_data = 0xffff;
+        }
+
+        hdrs[i] = m;
+        nb_hdrs++;
+    }
+
+    return nb_hdrs;
+}
+
 void *
 ff_mbuf_get(void *p, void *m, void *data, uint16_t len)
 {
@@ -383,6 +654,129 @@ ff_veth_process_packet(void *arg, void *m)
     ifp->if_input(ifp, mb);
 }
 
+/*
+ * With software LRO, segments of the same TCP flow are merged while the
+ * burst is walked and the merged chains are handed to the stack at the end,
+ * so a burst never outlives the rte_eth_rx_burst it came from.
+ * Segments without verified checksums bypass LRO, since merged chains are
+ * marked CSUM_DATA_VALID.
+ */
+void
+ff_veth_process_packets(void *arg, void **m, int count)
+{
+    struct ifnet *ifp = (struct ifnet *)arg;
+    struct ff_veth_softc *sc = (struct ff_veth_softc *)ifp->if_softc;
+    struct mbuf *mb;
+    int i, lro;
+
+    lro = sc->lro_enabled && (ifp->if_capenable & IFCAP_LRO);
+
+    for (i = 0; i < count; i++) {
+        mb = (struct mbuf *)m[i];
+        mb->m_pkthdr.rcvif = ifp;
+
+        if (lro && (mb->m_pkthdr.csum_flags & CSUM_DATA_VALID) &&
+            tcp_lro_rx(&sc->lro, mb, 0) == 0)
+            continue;
+
+        ifp->if_input(ifp, mb);
+    }
+
+    if (lro)
+        tcp_lro_flush_all(&sc->lro);
+}
+
+/*
+ * Whether the stack has a connection for the TCP 4-tuple of a received
+ * packet, established or still in the syncache, the addresses and ports
+ * are in network byte order.
+ */
+int
+ff_veth_tcp_lookup(void *arg, int ipv6, const void *saddr,
+    const void *daddr, uint16_t sport, uint16_t dport)
+{
+    struct ifnet *ifp = (struct ifnet *)arg;
+    struct epoch_tracker et;
+    struct in_conninfo inc;
+    struct inpcb *inp;
+    int found;
+
+    bzero(&inc, sizeof(inc));
+    inc.inc_fport = sport;
+    inc.inc_lport = dport;
+
+    NET_EPOCH_ENTER(et);
+#ifdef INET6
+    if (ipv6) {
+        inc.inc_flags |= INC_ISIPV6;
+        bcopy(saddr, &inc.inc6_faddr, sizeof(inc.inc6_faddr));
+        bcopy(daddr, &inc.inc6_laddr, sizeof(inc.inc6_laddr));
+        inp = in6_pcblookup(&V_tcbinfo, &inc.inc6_faddr, sport,
+            &inc.inc6_laddr, dport, INPLOOKUP_RLOCKPCB, ifp);
+    } else
+#endif
+    {
+        bcopy(saddr, &inc.inc_faddr, sizeof(inc.inc_faddr));
+        bcopy(daddr, &inc.inc_laddr, sizeof(inc.inc_laddr));
+        inp = in_pcblookup(&V_tcbinfo, inc.inc_faddr, sport,
+            inc.inc_laddr, dport, INPLOOKUP_RLOCKPCB, ifp);
+    }
+    if (inp != NULL) {
+        INP_RUNLOCK(inp);
+        found = 1;
+    } else {
+        /* The SYN was answered here, so is the ACK completing it */
+        found = syncache_exists(&inc);
+    }
+    NET_EPOCH_EXIT(et);
+
+    return (found);
+}
+
+/*
+ * Call cb for each TCP connection in up to nb chains of the hash table from
+ * *cursor on, with its addresses and ports in network byte order as in the
+ * packets received for it. Return 1 once the whole table has been walked
+ * and *cursor is back to the first chain.
+ */
+int
+ff_veth_tcp_foreach(ff_veth_tcp_cb_t cb, void *arg, unsigned *cursor,
+    unsigned nb)
+{
+    struct epoch_tracker et;
+    struct inpcb *inp;
+    u_long i;
+
+    NET_EPOCH_ENTER(et);
+    for (i = *cursor; i <= V_tcbinfo.ipi_hashmask && nb > 0; i++, nb--) {
+        CK_LIST_FOREACH(inp, &V_tcbinfo.ipi_hashbase[i], inp_hash) {
+            INP_RLOCK(inp);
+            if ((inp->inp_flags & INP_DROPPED) || inp->inp_fport == 0) {
+                INP_RUNLOCK(inp);
+                continue;
+            }
+#ifdef INET6
+            if (inp->inp_vflag & INP_IPV6)
+                cb(arg, 1, &inp->in6p_faddr, &inp->in6p_laddr,
+                    inp->inp_fport, inp->inp_lport);
+            else
+#endif
+                cb(arg, 0, &inp->inp_faddr, &inp->inp_laddr,
+                    inp->inp_fport, inp->inp_lport);
+            INP_RUNLOCK(inp);
+        }
+    }
+    NET_EPOCH_EXIT(et);
+
+    if (i > V_tcbinfo.ipi_hashmask) {
+        *cursor = 0;
+        return (1);
+    }
+
+    *cursor = i;
+    return (0);
+}
+
 static int
 ff_veth_transmit(struct ifnet *ifp, struct mbuf *m)
 {
@@ -629,19 +1023,28 @@ ff_veth_setup_interface(struct ff_veth_softc *sc, struct ff_port_cfg *cfg)
     ether_ifattach(ifp, sc->mac);
 
     if (cfg->hw_features.rx_csum) {
-        ifp->if_capabilities |= IFCAP_RXCSUM;
+        ifp->if_capabilities |= IFCAP_RXCSUM | IFCAP_RXCSUM_IPV6;
     }
     if (cfg->hw_features.tx_csum_ip) {
         ifp->if_capabilities |= IFCAP_TXCSUM;
         ifp->if_hwassist |= CSUM_IP;
     }
     if (cfg->hw_features.tx_csum_l4) {
-        ifp->if_hwassist |= CSUM_DELAY_DATA;
+        ifp->if_capabilities |= IFCAP_TXCSUM_IPV6;
+        ifp->if_hwassist |= CSUM_DELAY_DATA | CSUM_DELAY_DATA_IPV6;
     }
     if (cfg->hw_features.tx_tso) {
         ifp->if_capabilities |= IFCAP_TSO;
         ifp->if_hwassist |= CSUM_TSO;
     }
+    if (cfg->lro && !cfg->hw_features.rx_lro) {
+        if (tcp_lro_init_args(&sc->lro, ifp, MAX_PKT_BURST, 0) == 0) {
+            sc->lro_enabled = 1;
+            ifp->if_capabilities |= IFCAP_LRO;
+        } else {
+            printf("%s: Failed to init software LRO\n", sc->host_ifname);
+        }
+    }
 
     ifp->if_capenable = ifp->if_capabilities;
 
@@ -721,6 +1124,8 @@ ff_veth_attach(struct ff_port_cfg *cfg)
 
 fail:
     if (sc) {
+        if (sc->lro_enabled)
+            tcp_lro_free(&sc->lro);
         if (sc->host_ctx)
             ff_dpdk_deregister_if(sc->host_ctx);
 
@@ -735,6 +1140,8 @@ ff_veth_detach(void *arg)
 {
     struct ff_veth_softc *sc = (struct ff_veth_softc *)arg;
     if (sc) {
+        if (sc->lro_enabled)
+            tcp_lro_free(&sc->lro);
         ff_dpdk_deregister_if(sc->host_ctx);
         free(sc, M_DEVBUF);
     }
@@ -33,6 +33,8 @@ int ff_veth_detach(void *arg);
 
 void *ff_mbuf_gethdr(void *pkt, uint16_t total, void *data,
     uint16_t len, uint8_t rx_csum);
+int ff_mbuf_gethdr_burst(void **pkts, void **data, uint16_t *len,
+    uint16_t *total, int count, uint8_t rx_csum, void **hdrs);
 void *ff_mbuf_get(void *p, void *m, void *data, uint16_t len);
 void ff_mbuf_free(void *m);
 
@@ -46,9 +48,23 @@ struct ff_tx_offload;
 void ff_mbuf_tx_offload(void *m, struct ff_tx_offload *offload);
 
 void ff_veth_process_packet(void *arg, void *m);
+void ff_veth_process_packets(void *arg, void **m, int count);
 
 void *ff_veth_softc_to_hostc(void *softc);
 
+int ff_veth_tcp_lookup(void *arg, int ipv6, const void *saddr,
+    const void *daddr, uint16_t sport, uint16_t dport);
+
+typedef void (*ff_veth_tcp_cb_t)(void *arg, int ipv6, const void *saddr,
+    const void *daddr, uint16_t sport, uint16_t dport);
+int ff_veth_tcp_foreach(ff_veth_tcp_cb_t cb, void *arg, unsigned *cursor,
+    unsigned nb);
+
 void ff_mbuf_set_vlan_info(void *hdr, uint16_t vlan_tci);
 
+int ff_zc_completion_flush(void);
+int ff_zc_mbuf_attached(void *mbuf);
+void *ff_zc_mbuf_tx_ref(void *mbuf);
+void ff_zc_mbuf_tx_unref(void *ref);
+
 #endif /* ifndef _FSTACK_VETH_H */
@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2017-2021 THL A29 Limited, a Tencent company.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef _FSTACK_SYS_RMLOCK_H_
+#define _FSTACK_SYS_RMLOCK_H_
+
+#include_next <sys/rmlock.h>
+
+#ifdef FF_LOCK_ELISION
+/*
+ * The bodies in ff_lock.c are already empty; expand the hot-path
+ * entry points in place so callers don't pay for the call either.
+ */
+#undef rm_wlock
+#undef rm_wunlock
+#undef rm_rlock
+#undef rm_try_rlock
+#undef rm_runlock
+
+#define rm_wlock(rm) do {} while(0)
+#define rm_wunlock(rm) do {} while(0)
+#define rm_rlock(rm, tracker) do {} while(0)
+#define rm_try_rlock(rm, tracker) (1)
+#define rm_runlock(rm, tracker) do {} while(0)
+#endif
+
+#endif    /* _FSTACK_SYS_RMLOCK_H_ */
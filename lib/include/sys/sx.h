@@ -43,4 +43,30 @@
 #define _sx_slock_int(sx, arg) (0)
 #define _sx_sunlock_int(sx) do {} while(0)
 
+#if defined(FF_LOCK_ELISION) && !defined(INVARIANTS)
+/*
+ * Every lcore owns its own stack instance and never shares a socket
+ * buffer with another thread, so the inlined fcmpset in sblock() and
+ * friends buys nothing.  Compile sx locks down to nothing.  sx_xlocked()
+ * then can't tell the owner, so INVARIANTS builds keep the real locks
+ * for their assertions.
+ */
+#undef sx_xlock_
+#undef sx_xlock_sig_
+#undef sx_xunlock_
+#undef sx_slock_
+#undef sx_slock_sig_
+#undef sx_sunlock_
+#undef sx_xlocked
+
+#define sx_xlock_(sx, file, line) do {} while(0)
+#define sx_xlock_sig_(sx, file, line) (0)
+#define sx_xunlock_(sx, file, line) do {} while(0)
+#define sx_slock_(sx, file, line) do {} while(0)
+#define sx_slock_sig_(sx, file, line) (0)
+#define sx_sunlock_(sx, file, line) do {} while(0)
+#define sx_xlocked(sx) (1)
+#endif
+
+
 #endif    /* _FSTACK_SYS_SX_H_ */
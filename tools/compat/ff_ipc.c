@@ -31,6 +31,7 @@
 #include <rte_ring.h>
 #include <rte_mempool.h>
 #include <rte_malloc.h>
+#include <rte_memzone.h>
 #include <unistd.h>
 
 #include "ff_ipc.h"
@@ -186,3 +187,23 @@ ff_ipc_recv(struct ff_msg **msg, enum FF_MSG_TYPE msg_type)
 
     return ret;
 }
+
+const struct ff_stats *
+ff_ipc_stats(void)
+{
+    const struct rte_memzone *mz;
+
+    if (inited == 0) {
+        printf("ff ipc not inited\n");
+        return NULL;
+    }
+
+    char name[RTE_MEMZONE_NAMESIZE];
+    snprintf(name, RTE_MEMZONE_NAMESIZE, "%s%u", FF_STATS_MZ, ff_proc_id);
+    mz = rte_memzone_lookup(name);
+    if (mz == NULL) {
+        return NULL;
+    }
+
+    return (const struct ff_stats *)mz->addr;
+}
@@ -40,4 +40,7 @@ int ff_ipc_msg_free(struct ff_msg *msg);
 int ff_ipc_send(const struct ff_msg *msg);
 int ff_ipc_recv(struct ff_msg **msg, enum FF_MSG_TYPE msg_type);
 
+/* Get the shared stats of the F-Stack proccess, NULL if not found */
+const struct ff_stats *ff_ipc_stats(void);
+
 #endif
@@ -0,0 +1,156 @@
+#include <unistd.h>
+#include <string.h>
+#include <strings.h>
+#include <netinet/in.h>
+#include "ff_ipc.h"
+
+void
+usage(void)
+{
+    printf("Usage:\n");
+    printf("  flowctl [-p <f-stack proc_id>] -P <port_id> "
+        "-a|-d <tcp|udp>:[sport:]dport[:queue]\n"
+        "    use `-a` to steer the packets to queue\n"
+        "    use `-d` to remove the rule\n");
+}
+
+static int
+parse_rule(const char *s, struct ff_flow_args *flow)
+{
+    char buf[64], *fields[4], *p, *end;
+    unsigned long v[4];
+    int n = 0, i;
+
+    snprintf(buf, sizeof(buf), "%s", s);
+    for (p = strtok(buf, ":"); p != NULL && n < 4; p = strtok(NULL, ":")) {
+        fields[n++] = p;
+    }
+
+    if (flow->cmd == FF_FLOW_CMD_ADD ? (n != 3 && n != 4) : (n != 2 && n != 3)) {
+        return -1;
+    }
+
+    if (strcasecmp(fields[0], "tcp") == 0) {
+        flow->proto = IPPROTO_TCP;
+    } else if (strcasecmp(fields[0], "udp") == 0) {
+        flow->proto = IPPROTO_UDP;
+    } else {
+        return -1;
+    }
+
+    for (i = 1; i < n; i++) {
+        v[i] = strtoul(fields[i], &end, 10);
+        if (*end != '\0' || v[i] > UINT16_MAX) {
+            return -1;
+        }
+    }
+
+    /* sport is optional */
+    i = 1;
+    if (n == (flow->cmd == FF_FLOW_CMD_ADD ? 4 : 3)) {
+        flow->sport = v[i++];
+    }
+    flow->dport = v[i++];
+    if (flow->cmd == FF_FLOW_CMD_ADD) {
+        flow->queue = v[i];
+    }
+
+    return 0;
+}
+
+int flowctl_set(struct ff_flow_args *flow){
+    int            ret;
+    struct ff_msg *msg, *retmsg = NULL;
+
+    msg = ff_ipc_msg_alloc();
+    if (msg == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    msg->msg_type = FF_FLOW;
+    msg->flow = *flow;
+    ret = ff_ipc_send(msg);
+    if (ret < 0) {
+        errno = EPIPE;
+        ff_ipc_msg_free(msg);
+        return -1;
+    }
+
+    do {
+        if (retmsg != NULL) {
+            ff_ipc_msg_free(retmsg);
+        }
+
+        ret = ff_ipc_recv(&retmsg, msg->msg_type);
+        if (ret < 0) {
+            errno = EPIPE;
+            ff_ipc_msg_free(msg);
+            return -1;
+        }
+    } while (msg != retmsg);
+
+    ret = retmsg->result;
+    ff_ipc_msg_free(msg);
+
+    if (ret != 0) {
+        errno = ret;
+        return -1;
+    }
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int ch, ret;
+    const char *rule = NULL;
+    struct ff_flow_args flow = {.cmd = FF_FLOW_CMD_UNKNOWN};
+
+    ff_ipc_init();
+    while ((ch = getopt(argc, argv, "hp:P:a:d:")) != -1) {
+        switch(ch) {
+        case 'p':
+            ff_set_proc_id(atoi(optarg));
+            break;
+        case 'P':
+            flow.port_id = atoi(optarg);
+            break;
+        case 'a':
+        case 'd':
+            if (rule != NULL) {
+                usage();
+                ff_ipc_exit();
+                return -1;
+            }
+            flow.cmd = ch == 'a' ? FF_FLOW_CMD_ADD : FF_FLOW_CMD_DEL;
+            rule = optarg;
+            break;
+        case 'h':
+        default:
+            usage();
+            ff_ipc_exit();
+            return -1;
+        }
+    }
+
+    if (rule == NULL || parse_rule(rule, &flow) < 0) {
+        usage();
+        ff_ipc_exit();
+        return -1;
+    }
+
+    ret = flowctl_set(&flow);
+    if (ret < 0) {
+        printf("  fail to %s flow rule %s on port %u: %s\n",
+            flow.cmd == FF_FLOW_CMD_ADD ? "add" : "delete", rule,
+            flow.port_id, strerror(errno));
+    } else {
+        printf("  success to %s flow rule %s on port %u\n",
+            flow.cmd == FF_FLOW_CMD_ADD ? "add" : "delete", rule,
+            flow.port_id);
+    }
+
+    ff_ipc_exit();
+    return ret;
+}
@@ -13,7 +13,15 @@ int cpu_status(struct ff_top_args *top)
 {
     int            ret;
     struct ff_msg *msg, *retmsg = NULL;
-    
+    const struct ff_stats *stats;
+
+    /* Read the shared stats directly, fall back to the msg ring */
+    stats = ff_ipc_stats();
+    if (stats != NULL) {
+        *top = stats->top;
+        return 0;
+    }
+
     msg = ff_ipc_msg_alloc();
     if (msg == NULL) {
         errno = ENOMEM;
@@ -6,13 +6,59 @@ usage(void)
 {
     printf("Usage:\n");
     printf("  top [-p <f-stack proc_id>] [-P <max proc_id>] "
-        "[-d <secs>] [-n num] [-s]\n");
+        "[-d <secs>] [-n num] [-s] [-x]\n");
+}
+
+int port_status(int proc_id)
+{
+    const struct ff_stats *stats;
+    const struct ff_port_stats *ps;
+    unsigned int i, q;
+
+    stats = ff_ipc_stats();
+    if (stats == NULL) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    for (i = 0; i < RTE_MAX_ETHPORTS; i++) {
+        ps = &stats->port[i];
+        if (!ps->enabled) {
+            continue;
+        }
+
+        printf("|%9d|%5u|%6u|%16lu|%16lu|%16lu|%16lu|%12lu|%12lu|%12lu|%12lu|\n",
+            proc_id, i, ps->queue_id, ps->rx_packets, ps->rx_bytes,
+            ps->tx_packets, ps->tx_bytes, ps->rx_dropped, ps->tx_dropped,
+            ps->dispatch_dropped, ps->tx_nombuf);
+
+        if (ps->dispatch_dropped == 0) {
+            continue;
+        }
+
+        for (q = 0; q < FF_MAX_DISPATCH_QUEUES; q++) {
+            if (ps->dispatch_dropped_to[q]) {
+                printf("|%9s|%5s|%6s| disp dropped to queue %u: %lu\n",
+                    "", "", "", q, ps->dispatch_dropped_to[q]);
+            }
+        }
+    }
+
+    return 0;
 }
 
 int traffic_status(struct ff_traffic_args *traffic)
 {
     int            ret;
     struct ff_msg *msg, *retmsg = NULL;
+    const struct ff_stats *stats;
+
+    /* Read the shared stats directly, fall back to the msg ring */
+    stats = ff_ipc_stats();
+    if (stats != NULL) {
+        *traffic = stats->traffic;
+        return 0;
+    }
 
     msg = ff_ipc_msg_alloc();
     if (msg == NULL) {
@@ -50,7 +96,7 @@ int traffic_status(struct ff_traffic_args *traffic)
 int main(int argc, char **argv)
 {
     int ch, delay = 1, n = 0;
-    int single = 0;
+    int single = 0, ports = 0;
     unsigned int i, j;
     struct ff_traffic_args traffic = {0, 0, 0, 0}, otr;
     struct ff_traffic_args ptraffic[RTE_MAX_LCORE], potr[RTE_MAX_LCORE];
@@ -65,7 +111,7 @@ int main(int argc, char **argv)
 #define DIFF_P(member) (ptraffic[j].member - potr[j].member)
 #define ADD_S(member) (traffic.member += ptraffic[j].member)
 
-    while ((ch = getopt(argc, argv, "hp:P:d:n:s")) != -1) {
+    while ((ch = getopt(argc, argv, "hp:P:d:n:sx")) != -1) {
         switch(ch) {
         case 'p':
             proc_id = atoi(optarg);
@@ -90,6 +136,9 @@ int main(int argc, char **argv)
         case 's':
             single = 1;
             break;
+        case 'x':
+            ports = 1;
+            break;
         case 'h':
         default:
             usage();
@@ -98,6 +147,27 @@ int main(int argc, char **argv)
         }
     }
 
+    if (ports) {
+        if (max_proc_id == -1) {
+            max_proc_id = proc_id;
+        }
+
+        printf("|%9s|%5s|%6s|%16s|%16s|%16s|%16s|%12s|%12s|%12s|%12s|\n",
+            "proc_id", "port", "queue", "rx packets", "rx bytes",
+            "tx packets", "tx bytes", "rx dropped", "tx dropped",
+            "disp dropped", "tx nombuf");
+        for (j = proc_id; j <= max_proc_id; j++) {
+            ff_set_proc_id(j);
+            if (port_status(j)) {
+                printf("fstack stats not found, proc id:%d!\n", j);
+                ff_ipc_exit();
+                return -1;
+            }
+        }
+        ff_ipc_exit();
+        return 0;
+    }
+
     if (single) {
         if (max_proc_id == -1) {
             if (traffic_status(&traffic)) {